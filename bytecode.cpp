@@ -0,0 +1,533 @@
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+#include "clang/AST/Expr.h"
+#include "clang/AST/Stmt.h"
+
+#include "bytecode.h"
+#include "cast.h"
+#include "debug.h"
+#include "eval.h"
+#include "exit.h"
+#include "help.h"
+#include "mem.h"
+#include "types.h"
+
+using namespace clang;
+
+llvm::cl::opt<bool> UseBytecode("bytecode", llvm::cl::desc("Lower function bodies to bytecode before running them"), llvm::cl::cat(MyHelp));
+
+// Function bodies are lowered once into a flat list of instructions over a
+// small register file of EmuVal pointers. Control flow (scopes, loops, switch,
+// break, return) becomes jumps, and calls push an activation onto a stack kept
+// on the heap, so deep recursion in the emulated program doesn't use up the
+// host stack. Every statement exec_stmt runs is lowered, so the VM never goes
+// back into the tree walker for one. Each register holds an owned value or null.
+enum bc_opcode_t{
+	OP_LINE,    // node: stmt about to run, fires the same line event as exec_stmt
+	OP_EVAL,    // a = eval_rexpr(node)
+	OP_RUN,     // eval_discard(node)
+	OP_DECL,    // exec_decl(node)
+	OP_FAIL,    // node is a statement the interpreter can't handle
+	OP_PUSH,    // add_stack_frame(a)
+	OP_POP,     // pop_stack_frame
+	OP_JUMP,    // goto b
+	OP_TEST,    // goto b if expr_is_zero(node)
+	OP_SWITCH,  // consume a, goto the statement switch_target picks in switches[b]
+	OP_CALL,    // make the call node, leaving the result in call_results
+	OP_COUNT,   // start counter a of the counted_loop node, goto b if it can't be
+	OP_CTEST,   // goto b if counter a has reached its bound
+	OP_CSTEP,   // step counter a and store it
+	OP_RET,     // return a
+	OP_RETVOID, // return from a function with no return value
+	OP_END,     // fell off the end of the body
+};
+
+static const unsigned NO_TARGET = (unsigned)-1;
+
+struct bc_insn{
+	bc_opcode_t op;
+	unsigned a;
+	unsigned b;
+	const void* node;
+};
+
+struct bc_func{
+	std::vector<bc_insn> code;
+	unsigned num_regs;
+	unsigned num_counters;
+	std::vector<std::vector<unsigned> > switches; // start of each statement in a switch body, then its end
+};
+
+// a loop or switch that a break statement can leave
+struct bc_break_target{
+	unsigned depth;
+	std::vector<unsigned> jumps;
+};
+
+struct bc_compiler{
+	bc_func* func;
+	unsigned next_reg;
+	unsigned next_counter;
+	unsigned depth; // frames pushed since the start of the body
+	std::vector<bc_break_target> breaks;
+};
+
+static std::unordered_map<const FunctionDecl*, bc_func*> compiled;
+
+static unsigned emit(bc_compiler* c, bc_opcode_t op, unsigned a, unsigned b, const void* node){
+	bc_insn insn;
+	insn.op = op;
+	insn.a = a;
+	insn.b = b;
+	insn.node = node;
+	c->func->code.push_back(insn);
+	return c->func->code.size()-1;
+}
+
+static unsigned here(bc_compiler* c){
+	return c->func->code.size();
+}
+
+static void patch(bc_compiler* c, unsigned insn, unsigned target){
+	c->func->code[insn].b = target;
+}
+
+// registers are handed out in a stack discipline
+static unsigned alloc_reg(bc_compiler* c){
+	unsigned r = c->next_reg++;
+	if(c->next_reg > c->func->num_regs){
+		c->func->num_regs = c->next_reg;
+	}
+	return r;
+}
+
+static void free_reg(bc_compiler* c){
+	c->next_reg--;
+}
+
+// counters for counted loops are handed out the same way
+static unsigned alloc_counter(bc_compiler* c){
+	unsigned k = c->next_counter++;
+	if(c->next_counter > c->func->num_counters){
+		c->func->num_counters = c->next_counter;
+	}
+	return k;
+}
+
+static void free_counter(bc_compiler* c){
+	c->next_counter--;
+}
+
+// scopes that declare nothing get no frame; false if this one doesn't
+static bool push_scope(bc_compiler* c, const Stmt* s){
+	size_t bytes;
+	if(!scope_frame(s, &bytes)) return false;
+	emit(c, OP_PUSH, (unsigned)bytes, 0, nullptr); // frames are capped well below 4GB
+	c->depth++;
+	return true;
+}
+
+static void pop_scope(bc_compiler* c){
+	emit(c, OP_POP, 0, 0, nullptr);
+	c->depth--;
+}
+
+static void begin_breakable(bc_compiler* c){
+	bc_break_target t;
+	t.depth = c->depth;
+	c->breaks.push_back(t);
+}
+
+static void end_breakable(bc_compiler* c, unsigned target){
+	for(unsigned j : c->breaks.back().jumps){
+		patch(c, j, target);
+	}
+	c->breaks.pop_back();
+}
+
+static void compile_stmt(bc_compiler* c, const Stmt* s);
+
+// Operators that decide whether, or in what order, their operands are
+// evaluated. eval_rexpr rejects all of these today, which is the only reason
+// hoisting calls out of the expressions around them gives the same result.
+static bool controls_evaluation(const Stmt* s){
+	if(isa<AbstractConditionalOperator>(s)) return true;
+	if(!isa<BinaryOperator>(s)) return false;
+	switch(((const BinaryOperator*)s)->getOpcode()){
+	case BO_LAnd:
+	case BO_LOr:
+	case BO_Comma:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// in the order eval_rexpr reaches them: right before left for binary
+// operators, the callee and arguments before the call itself; false if the
+// expression has an operator that controls evaluation, so none can be hoisted
+static bool collect_calls(const Stmt* s, std::vector<const CallExpr*>* calls){
+	if(s == nullptr) return true;
+
+	if(isa<UnaryExprOrTypeTraitExpr>(s)){
+		// never evaluated
+		return true;
+	} else if(controls_evaluation(s)){
+		return false;
+	} else if(isa<BinaryOperator>(s)){
+		const BinaryOperator* op = (const BinaryOperator*)s;
+		return collect_calls(op->getRHS(), calls) && collect_calls(op->getLHS(), calls);
+	}
+	for(auto it = s->child_begin(); it != s->child_end(); it++){
+		if(!collect_calls(*it, calls)) return false;
+	}
+	if(isa<CallExpr>(s)){
+		calls->push_back((const CallExpr*)s);
+	}
+	return true;
+}
+
+// Calls inside of e are made by the VM before e is evaluated, rather than by
+// eval_rexpr, which then finds their results waiting in call_results. If any
+// can't be, eval_rexpr makes all of them itself, keeping their order.
+static void compile_calls(bc_compiler* c, const Expr* e){
+	std::vector<const CallExpr*> calls;
+	if(!collect_calls(e, &calls)) return;
+	for(const CallExpr* call : calls){
+		emit(c, OP_CALL, 0, 0, call);
+	}
+}
+
+static void compile_eval(bc_compiler* c, unsigned r, const Expr* e){
+	compile_calls(c, e);
+	emit(c, OP_EVAL, r, 0, e);
+}
+
+static void compile_expr_stmt(bc_compiler* c, const Expr* e){
+	compile_calls(c, e);
+	emit(c, OP_RUN, 0, 0, e);
+}
+
+// a jump to be patched, taken if the condition is zero
+static unsigned compile_test(bc_compiler* c, const Expr* e){
+	compile_calls(c, e);
+	return emit(c, OP_TEST, 0, NO_TARGET, e);
+}
+
+static void compile_switch(bc_compiler* c, const SwitchStmt* stmt){
+	const Stmt* code = stmt->getBody();
+	if(!isa<CompoundStmt>(code)){
+		// reported when it is reached, as exec_stmt does
+		emit(c, OP_FAIL, 0, 0, stmt);
+		return;
+	}
+	const CompoundStmt* body = (const CompoundStmt*)code;
+
+	emit(c, OP_LINE, 0, 0, stmt);
+	bool framed = push_scope(c, stmt);
+	unsigned r = alloc_reg(c);
+	compile_eval(c, r, stmt->getCond());
+
+	unsigned table = c->func->switches.size();
+	c->func->switches.push_back(std::vector<unsigned>());
+	emit(c, OP_SWITCH, r, table, stmt);
+	free_reg(c);
+
+	begin_breakable(c);
+	for(auto it = body->body_begin(); it != body->body_end(); it++){
+		c->func->switches[table].push_back(here(c));
+		compile_stmt(c, *it);
+	}
+	unsigned end = here(c);
+	c->func->switches[table].push_back(end);
+	end_breakable(c, end);
+	if(framed) pop_scope(c);
+}
+
+static void compile_stmt(bc_compiler* c, const Stmt* s){
+	if(s == nullptr) return;
+
+	if(isa<CompoundStmt>(s)){
+		const CompoundStmt* stmt = (const CompoundStmt*)s;
+		emit(c, OP_LINE, 0, 0, s);
+		bool framed = push_scope(c, s);
+		for(auto it = stmt->body_begin(); it != stmt->body_end(); it++){
+			compile_stmt(c, *it);
+		}
+		if(framed) pop_scope(c);
+	} else if(isa<DeclStmt>(s)){
+		const DeclStmt* stmt = (const DeclStmt*)s;
+		emit(c, OP_LINE, 0, 0, s);
+		for(auto it = stmt->decl_begin(); it != stmt->decl_end(); it++){
+			if(isa<VarDecl>(*it)){
+				compile_calls(c, ((const VarDecl*)*it)->getInit());
+			}
+			emit(c, OP_DECL, 0, 0, *it);
+		}
+	} else if(isa<Expr>(s)){
+		emit(c, OP_LINE, 0, 0, s);
+		compile_expr_stmt(c, (const Expr*)s);
+	} else if(isa<ReturnStmt>(s)){
+		const ReturnStmt* stmt = (const ReturnStmt*)s;
+		emit(c, OP_LINE, 0, 0, s);
+		if(stmt->getRetValue() == nullptr){
+			emit(c, OP_RETVOID, 0, 0, nullptr);
+			return;
+		}
+		unsigned r = alloc_reg(c);
+		compile_eval(c, r, stmt->getRetValue());
+		emit(c, OP_RET, r, 0, nullptr);
+		free_reg(c);
+	} else if(isa<IfStmt>(s)){
+		const IfStmt* stmt = (const IfStmt*)s;
+		emit(c, OP_LINE, 0, 0, s);
+		unsigned jz = compile_test(c, stmt->getCond());
+		compile_stmt(c, stmt->getThen());
+		if(stmt->getElse() == nullptr){
+			patch(c, jz, here(c));
+		} else {
+			unsigned skip = emit(c, OP_JUMP, 0, NO_TARGET, nullptr);
+			patch(c, jz, here(c));
+			compile_stmt(c, stmt->getElse());
+			patch(c, skip, here(c));
+		}
+	} else if(isa<ForStmt>(s)){
+		const ForStmt* stmt = (const ForStmt*)s;
+		const counted_loop* loop = find_counted_loop(stmt);
+		emit(c, OP_LINE, 0, 0, s);
+		bool framed = push_scope(c, s);
+		compile_stmt(c, stmt->getInit());
+		begin_breakable(c);
+		if(loop != nullptr){
+			// falls through to the ordinary loop below if it can't be counted
+			unsigned k = alloc_counter(c);
+			unsigned count = emit(c, OP_COUNT, k, NO_TARGET, loop);
+			unsigned top = emit(c, OP_CTEST, k, NO_TARGET, loop);
+			c->breaks.back().jumps.push_back(top);
+			compile_stmt(c, stmt->getBody());
+			emit(c, OP_CSTEP, k, 0, loop);
+			emit(c, OP_JUMP, 0, top, nullptr);
+			patch(c, count, here(c));
+			free_counter(c);
+		}
+		unsigned top = here(c);
+		unsigned test = NO_TARGET;
+		if(stmt->getCond() != nullptr){
+			test = compile_test(c, stmt->getCond());
+		}
+		compile_stmt(c, stmt->getBody());
+		if(stmt->getInc() != nullptr){
+			compile_expr_stmt(c, stmt->getInc());
+		}
+		emit(c, OP_JUMP, 0, top, nullptr);
+		unsigned end = here(c);
+		if(test != NO_TARGET){
+			patch(c, test, end);
+		}
+		end_breakable(c, end);
+		if(framed) pop_scope(c);
+	} else if(isa<NullStmt>(s)){
+		emit(c, OP_LINE, 0, 0, s);
+	} else if(isa<SwitchStmt>(s)){
+		compile_switch(c, (const SwitchStmt*)s);
+	} else if(isa<SwitchCase>(s)){
+		emit(c, OP_LINE, 0, 0, s);
+		compile_stmt(c, ((const SwitchCase*)s)->getSubStmt());
+	} else if(isa<BreakStmt>(s) && !c->breaks.empty()){
+		emit(c, OP_LINE, 0, 0, s);
+		for(unsigned d = c->depth; d > c->breaks.back().depth; d--){
+			emit(c, OP_POP, 0, 0, nullptr);
+		}
+		c->breaks.back().jumps.push_back(emit(c, OP_JUMP, 0, NO_TARGET, nullptr));
+	} else {
+		// exec_stmt can't run anything else either
+		emit(c, OP_FAIL, 0, 0, s);
+	}
+}
+
+static bc_func* compile_function(const FunctionDecl* f){
+	bc_func* func = new bc_func();
+	func->num_regs = 0;
+	func->num_counters = 0;
+	bc_compiler c;
+	c.func = func;
+	c.next_reg = 0;
+	c.next_counter = 0;
+	c.depth = 0;
+	compile_stmt(&c, f->getBody());
+	emit(&c, OP_END, 0, 0, nullptr);
+	compiled.insert(std::make_pair(f, func));
+	return func;
+}
+
+// lower everything up front so the first call of a function doesn't pay for it
+void compile_functions(void){
+	for(auto it = global_functions.cbegin(); it != global_functions.cend(); it++){
+		const FunctionDecl* f = (const FunctionDecl*)it->second.second;
+		if(compiled.find(f) == compiled.end()){
+			compile_function(f);
+		}
+	}
+}
+
+// one call running in the VM
+struct bc_activation{
+	const bc_func* func;
+	const bc_insn* code;
+	unsigned pc;
+	std::vector<const EmuVal*> regs;
+	std::vector<loop_counter> counters;
+	size_t depth; // stack_vars.size() on entry
+	const CallExpr* site; // null for the call run_function was given
+	saved_call saved;
+	llvm::DenseMap<const CallExpr*, const EmuVal*> results;
+};
+
+// results the instruction that just finished didn't use
+static void drop_results(bc_activation* act){
+	for(auto it = act->results.begin(); it != act->results.end(); ++it){
+		delete it->second;
+	}
+	act->results.clear();
+}
+
+static void push_activation(std::deque<bc_activation>* acts, const FunctionDecl* f, const CallExpr* site, const saved_call* saved){
+	const bc_func* func;
+	auto it = compiled.find(f);
+	if(it == compiled.end()){
+		func = compile_function(f);
+	} else {
+		func = it->second;
+	}
+
+	acts->emplace_back();
+	bc_activation* act = &acts->back();
+	act->func = func;
+	act->code = func->code.data();
+	act->pc = 0;
+	act->regs.assign(func->num_regs, nullptr);
+	act->counters.resize(func->num_counters);
+	act->depth = stack_vars.size();
+	act->site = site;
+	if(saved != nullptr){
+		act->saved = *saved;
+	}
+}
+
+// same contract as exec_stmt on the body: null if it just ended with no return
+// caller must free returned if not null
+const EmuVal* run_function(const FunctionDecl* f){
+	// a deque, so call_results can point into the top activation as more are pushed
+	std::deque<bc_activation> acts;
+	llvm::DenseMap<const CallExpr*, const EmuVal*>* save_results = call_results;
+	push_activation(&acts, f, nullptr, nullptr);
+	bc_activation* act = &acts.back();
+	call_results = &act->results;
+	const EmuVal* retval = nullptr;
+
+	for(;;){
+		const bc_insn* insn = &act->code[act->pc++];
+		switch(insn->op){
+		case OP_LINE:
+			curr_loc = ((const Stmt*)insn->node)->getLocStart();
+			debug_dump();
+			break;
+		case OP_EVAL:
+			act->regs[insn->a] = eval_rexpr((const Expr*)insn->node);
+			drop_results(act);
+			break;
+		case OP_RUN:
+			eval_discard((const Expr*)insn->node);
+			drop_results(act);
+			break;
+		case OP_DECL:
+			exec_decl((const Decl*)insn->node);
+			drop_results(act);
+			break;
+		case OP_FAIL:
+			((const Stmt*)insn->node)->dump();
+			cant_handle();
+		case OP_PUSH:
+			add_stack_frame(insn->a);
+			break;
+		case OP_POP:
+			pop_stack_frame();
+			break;
+		case OP_JUMP:
+			act->pc = insn->b;
+			break;
+		case OP_TEST:
+			if(expr_is_zero((const Expr*)insn->node)) act->pc = insn->b;
+			drop_results(act);
+			break;
+		case OP_SWITCH:
+		{
+			const EmuVal* value = act->regs[insn->a];
+			unsigned i = switch_target((const SwitchStmt*)insn->node, value);
+			delete value;
+			act->regs[insn->a] = nullptr;
+			act->pc = act->func->switches[insn->b][i];
+			break;
+		}
+		case OP_COUNT:
+			if(!start_counted_loop((const counted_loop*)insn->node, &act->counters[insn->a])) act->pc = insn->b;
+			break;
+		case OP_CTEST:
+			if(!counted_loop_test((const counted_loop*)insn->node, &act->counters[insn->a])) act->pc = insn->b;
+			break;
+		case OP_CSTEP:
+			counted_loop_step((const counted_loop*)insn->node, &act->counters[insn->a]);
+			break;
+		case OP_CALL:
+		{
+			const CallExpr* site = (const CallExpr*)insn->node;
+			const EmuVal* value;
+			saved_call saved;
+			const FunctionDecl* defn = enter_call(site, &value, &saved);
+			if(defn == nullptr){
+				act->results[site] = value;
+			} else {
+				push_activation(&acts, defn, site, &saved);
+				act = &acts.back();
+				call_results = &act->results;
+			}
+			break;
+		}
+		case OP_RET:
+			retval = act->regs[insn->a];
+			act->regs[insn->a] = nullptr;
+			goto done;
+		case OP_RETVOID:
+			retval = new EmuVoid();
+			goto done;
+		case OP_END:
+			goto done;
+		}
+		continue;
+
+	done:
+		for(unsigned i = 0; i < act->regs.size(); i++){
+			delete act->regs[i];
+		}
+		drop_results(act);
+		// returning from inside of nested scopes leaves their frames behind
+		while(stack_vars.size() > act->depth){
+			pop_stack_frame();
+		}
+		if(acts.size() == 1) break;
+
+		const CallExpr* site = act->site;
+		saved_call saved = act->saved;
+		acts.pop_back();
+		leave_call(&saved);
+		act = &acts.back();
+		call_results = &act->results;
+		act->results[site] = retval;
+		retval = nullptr;
+	}
+
+	call_results = save_results;
+	return retval;
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include "clang/AST/Decl.h"
+#include "llvm/Support/CommandLine.h"
+#include "types.h"
+
+using namespace clang;
+
+extern llvm::cl::opt<bool> UseBytecode;
+
+void compile_functions(void);
+const EmuVal* run_function(const FunctionDecl*);
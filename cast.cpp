@@ -1,8 +1,10 @@
 #include "clang/AST/Type.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/Support/raw_ostream.h"
 #include "cast.h"
 #include "eval.h"
 #include "exit.h"
+#include "log.h"
 #include "main.h"
 #include "types.h"
 
@@ -17,49 +19,109 @@ const EmuVal* cast_to(const EmuVal* orig, QualType t){
 	return orig->cast_to(t);
 }
 
-size_t getSizeOf(QualType qt){
-	if(qt->isIntegerType()){
-		return sizeof(emu_type_id_t)+bytes_in_num_type(getNumType(qt));
-	} else if(qt->isPointerType()){
-		return EMU_SIZE_PTR;
-	} else if(qt->isConstantArrayType()){
-		const ConstantArrayType* type = (const ConstantArrayType*)qt->getAsArrayTypeUnsafe();
-		size_t n = type->getSize().getLimitedValue();
-		size_t sub = getSizeOf(type->getElementType());
-		return n*sub+sizeof(emu_type_id_t);
-	} else if(qt->isStructureType()){
-		const RecordDecl* decl = qt->getAsStructureType()->getDecl();
-		unsigned int n=0;
-		for(auto it = decl->decls_begin(); it != decl->decls_end(); it++){
-			n++;
-		}
-		size_t ans = sizeof(emu_type_id_t);
-		for(auto it = decl->decls_begin(); it != decl->decls_end(); it++){
-			ans += getSizeOf(((const ValueDecl*)*it)->getType());
-		}
-		return ans;
-	} else if(qt->isUnionType()){
-		const RecordDecl* decl = qt->getAsUnionType()->getDecl();
-		unsigned int n=0;
-		for(auto it = decl->decls_begin(); it != decl->decls_end(); it++){
-			n++;
-		}
-		size_t ans = 0;
-		for(auto it = decl->decls_begin(); it != decl->decls_end(); it++){
-			size_t temp = getSizeOf(((const ValueDecl*)*it)->getType());
-			if(temp > ans) ans=temp;
+static llvm::DenseMap<const RecordDecl*, const record_layout*> layouts;
+
+const record_layout* get_layout(const RecordDecl* decl){
+	const RecordDecl* defn = decl->getDefinition();
+	if(defn == nullptr){
+		err_exit("Dealing with undefined record");
+	}
+	const auto it = layouts.find(defn);
+	if(it != layouts.end()) return it->second;
+
+	record_layout* layout = new record_layout();
+	layout->is_union = defn->isUnion();
+	size_t pos = 0;
+	layout->size = pos;
+	for(auto f = defn->field_begin(); f != defn->field_end(); f++){
+		QualType ft = f->getType();
+		size_t s = getValueSizeOf(ft);
+		layout->types.push_back(ft);
+		if(layout->is_union){
+			// members all overlap
+			layout->offsets.push_back(0);
+			if(pos+s > layout->size) layout->size = pos+s;
+		} else {
+			layout->offsets.push_back(pos);
+			pos += s;
+			layout->size = pos;
 		}
-		return ans;
 	}
-	llvm::errs() << "DOUG DEBUG: couldn't get size of unknown type:\n";
-	qt.dump();
-	cant_cast();
+	EMU_LOG(LOG_TYPES, LOG_LEVEL_TRACE) << "DOUG DEBUG: laid out record with "<<layout->offsets.size()<<" fields in "<<layout->size<<" bytes\n";
+	layouts.insert(std::make_pair(defn, (const record_layout*)layout));
+	return layout;
 }
 
-static const EmuPtr* newarr(QualType arrtype, const ArrayType* type, size_t num){
-	llvm::errs() << "DOUG DEBUG: newarr 0\n";
-	const EmuVal* sub = from_lvalue(lvalue(nullptr,type->getElementType(),0));
-	llvm::errs() << "DOUG DEBUG: newarr 0.5\n";
+static size_t value_size_of_entry(type_entry*);
+
+static size_t size_of_entry(type_entry* t){
+	if(t->sized) return t->size;
+	size_t ans;
+	switch(t->kind){
+	case TYPE_KIND_NUM:
+		ans = bytes_in_num_type(t->num);
+		break;
+	case TYPE_KIND_PTR:
+		ans = EMU_SIZE_PTR;
+		break;
+	case TYPE_KIND_ARRAY:
+		ans = t->count*size_of_entry(type_at(t->sub));
+		break;
+	case TYPE_KIND_STRUCT:
+	case TYPE_KIND_UNION:
+		// records are laid out the same in memory as their values
+		ans = value_size_of_entry(t);
+		break;
+	default:
+		llvm::errs() << "DOUG DEBUG: couldn't get size of unknown type:\n";
+		t->type.dump();
+		cant_cast();
+	}
+	t->size = ans;
+	t->sized = true;
+	return ans;
+}
+
+size_t getSizeOf(QualType qt){
+	return size_of_entry(type_lookup(qt));
+}
+
+static size_t value_size_of_entry(type_entry* t){
+	if(t->value_sized) return t->value_size;
+	size_t ans;
+	switch(t->kind){
+	case TYPE_KIND_NUM:
+		ans = bytes_in_num_type(t->num);
+		break;
+	case TYPE_KIND_PTR:
+	case TYPE_KIND_ARRAY:
+	case TYPE_KIND_VLA:
+		ans = EMU_SIZE_PTR;
+		break;
+	case TYPE_KIND_FUNC:
+		ans = EMU_SIZE_FUNC;
+		break;
+	case TYPE_KIND_STRUCT:
+	case TYPE_KIND_UNION:
+		ans = get_layout(((const RecordType*)t->type.getTypePtr())->getDecl())->size;
+		break;
+	default:
+		llvm::errs() << "\n\nDEBUG: Couldn't get lvalue from type:\n";
+		t->type.dump();
+		cant_handle();
+	}
+	t->value_size = ans;
+	t->value_sized = true;
+	return ans;
+}
+
+size_t getValueSizeOf(QualType qt){
+	return value_size_of_entry(type_lookup(qt));
+}
+
+// a block of num copies of sub, which is freed; arrays are values as pointers
+// to their block
+static const EmuPtr* fill_array(QualType arrtype, const EmuVal* sub, size_t num){
 	size_t s = sub->size();
 	if(s == 0){
 		err_exit("Tried to create array of zero-size objects");
@@ -69,21 +131,25 @@ static const EmuPtr* newarr(QualType arrtype, const ArrayType* type, size_t num)
 		err_exit("Array size overflow");
 	}
 	size_t size = s*num;
-	llvm::errs() << "DOUG DEBUG: newarr 1\n";
 	mem_block* block = new mem_block(static_init?MEM_TYPE_GLOBAL:MEM_TYPE_STACK, size);
-	llvm::errs() << "DOUG DEBUG: newarr 2\n";
+	EMU_LOG(LOG_MEM, LOG_LEVEL_TRACE) << "DOUG DEBUG: newarr of "<<num<<" elements in block id "<<block->id<<"\n";
 	for(size_t i = 0; i < size; i+=s){
 		block->write(sub, i);
 	}
-	llvm::errs() << "DOUG DEBUG: newarr 3\n";
+	delete sub;
 	return new EmuPtr(mem_ptr(block, 0), arrtype);
 }
 
+static const EmuPtr* newarr(QualType arrtype, const ArrayType* type, size_t num){
+	return fill_array(arrtype, from_lvalue(lvalue(nullptr,type->getElementType(),0)), num);
+}
+
 const EmuVal* zero_init(QualType qt){
-	if(qt->isIntegerType()){
-		num_type_t t = getNumType(qt);
-		#define INITZEROCASE(T) case T: return new EmuNum<T>(llvm::APInt(bits_in_num_type(T),0,is_num_type_signed(T)));
-		switch(t){
+	const type_entry* t = type_lookup(qt);
+	switch(t->kind){
+	case TYPE_KIND_NUM:
+		#define INITZEROCASE(T) case T: return new EmuNum<T>(STATUS_DEFINED, 0);
+		switch(t->num){
 			INITZEROCASE(NUM_TYPE_BOOL)
 			INITZEROCASE(NUM_TYPE_CHAR)
 			INITZEROCASE(NUM_TYPE_UCHAR)
@@ -96,51 +162,43 @@ const EmuVal* zero_init(QualType qt){
 			INITZEROCASE(NUM_TYPE_LONGLONG)
 			INITZEROCASE(NUM_TYPE_ULONGLONG)
 		}
-	} else if(qt->isPointerType()){
+		#undef INITZEROCASE
+		break;
+	case TYPE_KIND_PTR:
 		return new EmuPtr(mem_ptr(nullptr,0),qt);
-	} else if(qt->isConstantArrayType()){
-		const ConstantArrayType* type = (const ConstantArrayType*)qt.getTypePtr();
-		unsigned int n = type->getSize().getLimitedValue();
+	case TYPE_KIND_ARRAY:
+		// the same pointer representation a struct's layout gives array fields
+		return fill_array(qt, zero_init(type_at(t->sub)->type), t->count);
+	case TYPE_KIND_STRUCT:
+	case TYPE_KIND_UNION:
+	{
+		const record_layout* layout = get_layout(((const RecordType*)t->type.getTypePtr())->getDecl());
+		// only the first member of a union is initialized
+		unsigned int n = layout->types.size();
+		if(layout->is_union && n > 1) n = 1;
 		const EmuVal** arr = new const EmuVal*[n];
 		for(unsigned int i=0; i<n; i++){
-			const EmuVal* z = zero_init(type->getElementType());
-			arr[i] = z;
+			arr[i] = zero_init(layout->types[i]);
 		}
-		EmuStruct* ans = new EmuStruct(STATUS_DEFINED, qt, n, arr);
-		ans->repr_type_id = 0;
-		return ans;
-	} else if(qt->isStructureType()){
-		const RecordDecl* decl = qt->getAsStructureType()->getDecl();
-		unsigned int n = 0;
-		for(auto it = decl->decls_begin(); it != decl->decls_end(); it++){
-			n++;
-		}
-		const EmuVal** arr = new const EmuVal*[n];
-		unsigned int i=0;
-		for(auto it = decl->decls_begin(); it != decl->decls_end(); it++){
-			arr[i++] = zero_init(((const ValueDecl*)*it)->getType());
-		}
-		EmuStruct* ans = new EmuStruct(STATUS_DEFINED, qt, n, arr);
-		ans->repr_type_id = 0;
-		return ans;
-	} else if(qt->isUnionType()){
-		const RecordDecl* decl = qt->getAsUnionType()->getDecl();
-		return zero_init(((const ValueDecl*)*decl->decls_begin())->getType());
+		return new EmuStruct(STATUS_DEFINED, qt, n, arr);
+	}
+	default:
+		break;
 	}
 	cant_cast();
 }
 
 // caller must free returned pointer
 const EmuVal* from_lvalue(lvalue l){
-	QualType qt = l.type.getCanonicalType();
-	llvm::errs() << "DOUG DEBUG: from_lvalue called, type is ";
-	qt.dump();
-	llvm::errs() << "\n";
-	void* loc;
-	size_t space;
+	if(EMU_LOG_ON(LOG_TYPES, LOG_LEVEL_TRACE)){
+		llvm::errs() << "DOUG DEBUG: from_lvalue called, type is ";
+		l.type.getCanonicalType().dump();
+		llvm::errs() << "\n";
+	}
+	size_t space = 0;
 
 	if(l.ptr.block == nullptr){
-		loc = nullptr;
+		return from_repr(l.type, nullptr, 0);
 	} else {
 		if(l.ptr.block->memtype == MEM_TYPE_FREED){
 			err_exit("Tried to load from freed memory\n");
@@ -151,21 +209,72 @@ const EmuVal* from_lvalue(lvalue l){
 			llvm::errs() << "\n\nDEBUG: " << o << ">" << s << "\n";
 			err_exit("Tried to read from invalid location\n");
 		}
-		loc = (void*)&((char*)l.ptr.block->data)[l.ptr.offset];
 		space = s-o;
 	}
+	repr_ptr loc = l.ptr.block->at(l.ptr.offset);
+	return from_repr(l.type, &loc, space);
+}
 
-	llvm::errs() << "DOUG DEBUG: from_lvalue at 1\n";
+// from_lvalue for a number, without making an EmuVal
+emu_num load_num(const lvalue& l){
+	const type_entry* t = type_lookup(l.type);
+	if(t->kind != TYPE_KIND_NUM){
+		const EmuVal* v = from_lvalue(l);
+		emu_num ans(v); // can't be cast
+		delete v;
+		return ans;
+	}
+	if(l.ptr.block == nullptr){
+		return emu_num(STATUS_UNINITIALIZED, t->num, 0);
+	}
+	if(l.ptr.block->memtype == MEM_TYPE_FREED){
+		err_exit("Tried to load from freed memory\n");
+	}
+	size_t s = l.ptr.block->size;
+	size_t o = l.ptr.offset;
+	if(o > s){
+		llvm::errs() << "\n\nDEBUG: " << o << ">" << s << "\n";
+		err_exit("Tried to read from invalid location\n");
+	}
+	size_t space = s-o;
+	if(space < bytes_in_num_type(t->num)) bad_memread();
+	repr_ptr loc = l.ptr.block->at(o);
+	#define DOCASE(N) case N: { \
+		const EmuNum<N> v(loc, space); \
+		return emu_num(v.status, N, v.raw); \
+	}
+	switch(t->num){
+		DOCASE(NUM_TYPE_BOOL)
+		DOCASE(NUM_TYPE_CHAR)
+		DOCASE(NUM_TYPE_UCHAR)
+		DOCASE(NUM_TYPE_SHORT)
+		DOCASE(NUM_TYPE_USHORT)
+		DOCASE(NUM_TYPE_INT)
+		DOCASE(NUM_TYPE_UINT)
+		DOCASE(NUM_TYPE_LONG)
+		DOCASE(NUM_TYPE_ULONG)
+		DOCASE(NUM_TYPE_LONGLONG)
+		DOCASE(NUM_TYPE_ULONGLONG)
+	}
+	#undef DOCASE
+	cant_cast();
+}
 
-	if(qt->isIntegerType()){
+// Decodes a value of the given type from its representation at loc, with space
+// bytes readable there. A null loc makes up an uninitialized value.
+// caller must free returned pointer
+const EmuVal* from_repr(QualType type, const repr_ptr* loc, size_t space){
+	const type_entry* t = type_lookup(type);
+	QualType qt = t->type;
+	switch(t->kind){
+	case TYPE_KIND_NUM:
 		#define DOCASE(N) case N: { \
 			if(loc == nullptr) return new EmuNum<N>(STATUS_UNINITIALIZED); \
 			if(space < bytes_in_num_type(N)) bad_memread(); \
-			return new EmuNum<N>(loc); \
+			return new EmuNum<N>(*loc, space); \
 		}
 
-		num_type_t t = getNumType(qt);
-		switch(t){
+		switch(t->num){
 			DOCASE(NUM_TYPE_BOOL)
 			DOCASE(NUM_TYPE_CHAR)
 			DOCASE(NUM_TYPE_UCHAR)
@@ -181,59 +290,54 @@ const EmuVal* from_lvalue(lvalue l){
 			llvm::errs() << "DOUG DEBUG: arith type not supported?\n";
 			cant_cast();
 		}
-	}
-
-	const Type* ty = qt.getTypePtr();
-	llvm::errs() << "DOUG DEBUG: from_lvalue at 2:";
-	ty->dump();
-	llvm::errs() << "\n";
-	if (ty->isPointerType()){
-		if(loc == nullptr) return new EmuPtr(STATUS_UNINITIALIZED, l.type);
+		#undef DOCASE
+	case TYPE_KIND_PTR:
+		if(loc == nullptr) return new EmuPtr(STATUS_UNINITIALIZED, type);
 		if(space < EMU_SIZE_PTR) bad_memread();
-		llvm::errs() << "DOUG DEBUG: returning EmuPtr with storage at block id="<< l.ptr.block->id <<" and offset "<<l.ptr.offset<<"\n";
-		return new EmuPtr(loc, l.type);
-	} else if (ty->isConstantArrayType()){
+		EMU_LOG(LOG_TYPES, LOG_LEVEL_TRACE) << "DOUG DEBUG: returning EmuPtr with storage at "<<((void*)loc->data)<<"\n";
+		return new EmuPtr(*loc, space, type);
+	case TYPE_KIND_ARRAY:
 		if(loc == nullptr){
-			const ConstantArrayType *type = (const ConstantArrayType*)ty;
-			return newarr(qt, type, type->getSize().getLimitedValue());
+			const ConstantArrayType *type = (const ConstantArrayType*)qt.getTypePtr();
+			return newarr(qt, type, t->count);
 		}
 		if(space < EMU_SIZE_PTR){
 			llvm::errs() << "DOUG DEBUG: "<<space<<" vs "<<EMU_SIZE_PTR<<"\n";
 			bad_memread();
 		}
-		return new EmuPtr(loc, l.type);
-	} else if (ty->isVariableArrayType()){
+		return new EmuPtr(*loc, space, type);
+	case TYPE_KIND_VLA:
 		if(loc == nullptr){
-			const VariableArrayType *type = (const VariableArrayType*)ty;
+			const VariableArrayType *type = (const VariableArrayType*)qt.getTypePtr();
 			const EmuVal* temp = eval_rexpr(type->getSizeExpr());
-			const Type* t = temp->obj_type.getCanonicalType().getTypePtr();
-			if(!isa<BuiltinType>(t) || (((const BuiltinType*)t)->getKind() != BuiltinType::Int)){
+			const Type* st = temp->obj_type.getCanonicalType().getTypePtr();
+			if(!isa<BuiltinType>(st) || (((const BuiltinType*)st)->getKind() != BuiltinType::Int)){
 				cant_handle();
 			}
-			const llvm::APInt* size = &((const EmuNum<NUM_TYPE_INT>*)temp)->val;
-			if(size->isNegative()){
+			int64_t size = ((const EmuNum<NUM_TYPE_INT>*)temp)->sext();
+			if(size < 0){
 				err_exit("Tried to create negative length array\n");
 			}
-			if(size->ugt(SIZE_MAX)){
-				err_exit("Requested array size too big\n");
-			}
 			delete temp;
-			return newarr(qt, type, (size_t)size->getLimitedValue());
+			return newarr(qt, type, (size_t)size);
 		}
 		if(space < EMU_SIZE_PTR) bad_memread();
-		return new EmuPtr(loc, l.type);
-	} else if (ty->isFunctionType()){
-		if(loc == nullptr) return new EmuFunc(STATUS_UNINITIALIZED, l.type);
+		return new EmuPtr(*loc, space, type);
+	case TYPE_KIND_FUNC:
+		if(loc == nullptr) return new EmuFunc(STATUS_UNINITIALIZED, type);
 		if(space < EMU_SIZE_FUNC){
 			bad_memread();
 		}
-		return new EmuFunc(loc, l.type);
-	} else if (ty->isRecordType()){
-		// null specially handled by the struct impl, just pass the lvalue
-		return new EmuStruct(l);
+		return new EmuFunc(*loc, space, type);
+	case TYPE_KIND_STRUCT:
+	case TYPE_KIND_UNION:
+		// null specially handled by the struct impl
+		return new EmuStruct(loc, space, type);
+	default:
+		break;
 	}
 	llvm::errs() << "\n\nDEBUG: Couldn't get lvalue from type:\n";
-	ty->dump();
+	qt.dump();
 	cant_handle();
 }
 /*
@@ -260,7 +364,7 @@ emu_type_id_t type_id_from_type(QualType t){
 bool is_scalar_zero(const EmuVal* v){
 	QualType t = v->obj_type.getCanonicalType();
 	if(t == IntType){
-		return ((const EmuNum<NUM_TYPE_INT>*)v)->val == 0;
+		return ((const EmuNum<NUM_TYPE_INT>*)v)->raw == 0;
 	}
 	cant_handle();
 }
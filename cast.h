@@ -1,9 +1,27 @@
+#pragma once
+#include <vector>
+#include "clang/AST/Decl.h"
 #include "clang/AST/Type.h"
 #include "types.h"
 #include "mem.h"
 
+// where each field of a struct or union sits in its memory representation,
+// in the order of RecordDecl::fields()
+class record_layout{
+public:
+	bool is_union;
+	size_t size;
+	std::vector<size_t> offsets;
+	std::vector<QualType> types;
+};
+
+const record_layout* get_layout(const RecordDecl*);
 size_t getSizeOf(QualType);
+// what sizeof gives: the size of the value from_lvalue makes for the type
+size_t getValueSizeOf(QualType);
 const EmuVal* zero_init(QualType);
 const EmuVal* cast_to(const EmuVal*, QualType);
 const EmuVal* from_lvalue(lvalue);
+emu_num load_num(const lvalue&);
+const EmuVal* from_repr(QualType, const repr_ptr*, size_t);
 bool is_scalar_zero(const EmuVal*);
@@ -2,6 +2,7 @@
 #include "cast.h"
 #include "debug.h"
 #include "eval.h"
+#include "log.h"
 #include "main.h"
 #include "mem.h"
 
@@ -17,7 +18,9 @@ void debug_dump(const char* exc){
 	int ms = main_source;
 	int s = curr_source;
 	if(exc != nullptr) llvm::errs() << "DOUG DEBUG: ending with exception " << exc << "\n";
-	llvm::errs() << "DOUG DEBUG file " << sources[s]->getSourceManager().getFilename(curr_loc) << " line " << sources[s]->getSourceManager().getSpellingLineNumber(curr_loc) << "\n";
+	if(exc != nullptr || EMU_LOG_ON(LOG_EVAL, LOG_LEVEL_TRACE)){
+		llvm::errs() << "DOUG DEBUG file " << sources[s]->getSourceManager().getFilename(curr_loc) << " line " << sources[s]->getSourceManager().getSpellingLineNumber(curr_loc) << "\n";
+	}
 	if(lastline != 0x42424242) return;
 
 	if(exc == nullptr && s != ms) return;
@@ -101,9 +104,9 @@ void debug_dump(const char* exc){
 	}
 	llvm::outs() << "\n},\n\"heap\": {\n";
 	first = true;
-	for(auto it = active_mem.cbegin(); it != active_mem.cend(); it++){
+	for(auto it = active_mem.cbegin(); it != active_mem.cend(); ++it){
 		std::string typedesc;
-		mem_block* block = it->second;
+		mem_block* block = *it;
 		switch(block->memtype){
 		case MEM_TYPE_STATIC: typedesc = "STATIC"; break;
 		case MEM_TYPE_GLOBAL: typedesc = "GLOBAL"; break;
@@ -122,22 +125,22 @@ void debug_dump(const char* exc){
 		llvm::outs() << "\"" << block->id << "\": [\"CLASS\", \""<<typedesc<<"\", []";
 
 		size_t currpos = 0;
-		for(rbnode<mem_tag>* curr = block->firsttag; curr != nullptr; curr=curr->value.next){
-			size_t pos = curr->value.offset;
+		for(const mem_tag* curr = block->tags.begin(); curr != block->tags.end(); curr++){
+			size_t pos = curr->offset;
 			if(pos > currpos){
 				llvm::outs() << ",[\"\",\"" << (pos - currpos) << " bytes uninitialized\"]\n";
 			}
 			llvm::outs() << ",[\"\",[\"REF\",\""<< block->id << "O" << pos << "\"]]\n";
-			currpos += curr->value.typesize*curr->value.count;
+			currpos += curr->typesize*curr->count;
 		}
 		if(currpos < block->size){
 			llvm::outs() << ",[\"\",\"" << (block->size - currpos) << " bytes uninitialized\"]\n";
 		}
 		llvm::outs() << "] ";
 	}
-	for(auto it = active_mem.cbegin(); it != active_mem.cend(); it++){
+	for(auto it = active_mem.cbegin(); it != active_mem.cend(); ++it){
 		std::string typedesc;
-		mem_block* block = it->second;
+		mem_block* block = *it;
 		switch(block->memtype){
 		case MEM_TYPE_STATIC: typedesc = "STATIC"; break;
 		case MEM_TYPE_GLOBAL: typedesc = "GLOBAL"; break;
@@ -149,12 +152,12 @@ void debug_dump(const char* exc){
 			continue;
 		}
 
-		for(rbnode<mem_tag>* curr = block->firsttag; curr != nullptr; curr=curr->value.next){
-			size_t pos = curr->value.offset;
-			size_t typesize = curr->value.typesize;
-			QualType qt = curr->value.type;
+		for(const mem_tag* curr = block->tags.begin(); curr != block->tags.end(); curr++){
+			size_t pos = curr->offset;
+			size_t typesize = curr->typesize;
+			QualType qt = curr->type;
 			llvm::outs() << ", \"" << block->id << "O" << pos << "\": [\"LIST\"";
-			size_t count = curr->value.count;
+			size_t count = curr->count;
 			for(size_t i = 0; i < count; i++){
 				const EmuVal* temp = from_lvalue(lvalue(block, qt, pos+i*typesize));
 				if((temp->obj_type->isPointerType() || temp->obj_type->isArrayType()) && temp->status == STATUS_DEFINED){
@@ -31,6 +31,30 @@ static const uint32_t EMU_TYPE_NUM_MASK = 0x40404040;
 static const uint32_t EMU_TYPE_PTR_MASK = EMU_TYPE_PTR_ID;
 static const uint32_t EMU_TYPE_UNINIT_MASK = 0x80808080;
 
+// Blocks keep these apart from their values, one per byte: a value's tag is at
+// its first byte and its other bytes are TAG_CONT. Only four bits are used.
+enum tag_t{
+	TAG_NONE,     // never written
+	TAG_CONT,     // part of the value whose tag is at an earlier byte
+	TAG_INVALID,  // an undefined value
+	TAG_UNINIT,   // an uninitialized value of any type
+	TAG_BOOL,
+	TAG_CHAR,
+	TAG_SHORT,
+	TAG_INT,
+	TAG_LONG,
+	TAG_LONGLONG,
+	TAG_PTR,
+	TAG_FUNC,
+	TAG_STACKPOS,
+};
+
+// why a block died, kept in its tombstone
+enum death_t{
+	DEATH_FREED,        // passed to free
+	DEATH_OUT_OF_SCOPE, // a local whose scope ended
+};
+
 enum mem_type_t{
 	MEM_TYPE_STATIC,
 	MEM_TYPE_GLOBAL,
@@ -41,6 +65,13 @@ enum mem_type_t{
 	MEM_TYPE_FREED,
 };
 
+// where a block's data came from, so it can be given back there
+enum storage_t{
+	STORAGE_OWN,   // alloc_block
+	STORAGE_FRAME, // the block itself and its data are in a frame's space
+	STORAGE_HEAP,  // a chunk of one of the heap's size classes
+};
+
 enum num_type_t{
 	NUM_TYPE_BOOL,
 	NUM_TYPE_CHAR,
@@ -54,3 +85,14 @@ enum num_type_t{
 	NUM_TYPE_LONGLONG,
 	NUM_TYPE_ULONGLONG,
 };
+
+enum type_kind_t{
+	TYPE_KIND_OTHER,
+	TYPE_KIND_NUM,
+	TYPE_KIND_PTR,
+	TYPE_KIND_ARRAY,
+	TYPE_KIND_VLA,
+	TYPE_KIND_FUNC,
+	TYPE_KIND_STRUCT,
+	TYPE_KIND_UNION,
+};
@@ -1,15 +1,21 @@
+#include <algorithm>
 #include <limits.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "clang/AST/Expr.h"
 #include "clang/AST/Stmt.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
 
+#include "bytecode.h"
 #include "cast.h"
 #include "debug.h"
 #include "eval.h"
 #include "exit.h"
 #include "external.h"
 #include "help.h"
+#include "log.h"
 #include "main.h"
 #include "mem.h"
 #include "types.h"
@@ -41,59 +47,540 @@ static lvalue get_nonstack_var(std::string name){
 	return lvalue(nullptr, RawType, 0);
 }
 
+// where a variable lives, worked out once per decl so DeclRefExprs don't
+// need to look anything up by name
+class var_slot{
+public:
+	bool global;
+	unsigned depth; // relative to frame_base
+	unsigned num;
+	lvalue loc; // only for globals
+
+	var_slot(unsigned d, unsigned n)
+		: global(false),depth(d),num(n),loc(nullptr, RawType, 0)
+	{
+	}
+
+	var_slot(lvalue l)
+		: global(true),depth(0),num(0),loc(l)
+	{
+	}
+};
+
+static llvm::DenseMap<const ValueDecl*, var_slot> var_slots;
+static llvm::DenseSet<const FunctionDecl*> resolved_functions;
+
+// what the frame of a compound, for or switch statement needs, worked out once
+class scope_layout{
+public:
+	unsigned vars; // declared directly in the scope, not in nested ones
+	size_t bytes; // space set aside for them when the frame is pushed
+};
+
+static llvm::DenseMap<const Stmt*, scope_layout> scope_layouts;
+
+// locals bigger than this get blocks of their own
+static const size_t MAX_FRAME_BYTES = (size_t)1 << 20;
+
+static size_t local_bytes(QualType qt){
+	switch(type_lookup(qt)->kind){
+	case TYPE_KIND_NUM:
+	case TYPE_KIND_PTR:
+	case TYPE_KIND_ARRAY:
+	case TYPE_KIND_VLA:
+	case TYPE_KIND_FUNC:
+	case TYPE_KIND_STRUCT:
+	case TYPE_KIND_UNION:
+		return local_space(getValueSizeOf(qt));
+	default:
+		return 0; // e.g. va_list, left to new_local to allocate
+	}
+}
+
+// adds up what a scope declares itself, leaving nested scopes to their own frames
+static void lay_out_scope(const Stmt* s, scope_layout* l){
+	if(s == nullptr) return;
+
+	if(isa<DeclStmt>(s)){
+		const DeclStmt* stmt = (const DeclStmt*)s;
+		for(auto it = stmt->decl_begin(); it != stmt->decl_end(); it++){
+			if(!isa<VarDecl>(*it)) continue;
+			l->vars++;
+			size_t n = local_bytes(((const VarDecl*)*it)->getType());
+			if(n <= MAX_FRAME_BYTES - l->bytes){
+				l->bytes += n;
+			}
+		}
+	} else if(isa<IfStmt>(s)){
+		const IfStmt* stmt = (const IfStmt*)s;
+		lay_out_scope(stmt->getThen(), l);
+		lay_out_scope(stmt->getElse(), l);
+	} else if(isa<SwitchCase>(s)){
+		lay_out_scope(((const SwitchCase*)s)->getSubStmt(), l);
+	}
+}
+
+bool scope_frame(const Stmt* s, size_t* bytes){
+	auto it = scope_layouts.find(s);
+	if(it == scope_layouts.end()){
+		scope_layout l;
+		l.vars = 0;
+		l.bytes = 0;
+		if(isa<CompoundStmt>(s)){
+			const CompoundStmt* stmt = (const CompoundStmt*)s;
+			for(auto it2 = stmt->body_begin(); it2 != stmt->body_end(); it2++){
+				lay_out_scope(*it2, &l);
+			}
+		} else if(isa<ForStmt>(s)){
+			const ForStmt* stmt = (const ForStmt*)s;
+			lay_out_scope(stmt->getInit(), &l);
+			lay_out_scope(stmt->getBody(), &l);
+		} else if(isa<SwitchStmt>(s)){
+			const Stmt* body = ((const SwitchStmt*)s)->getBody();
+			if(isa<CompoundStmt>(body)){
+				const CompoundStmt* stmt = (const CompoundStmt*)body;
+				for(auto it2 = stmt->body_begin(); it2 != stmt->body_end(); it2++){
+					lay_out_scope(*it2, &l);
+				}
+			}
+		}
+		it = scope_layouts.insert(std::make_pair(s, l)).first;
+	}
+	*bytes = it->second.bytes;
+	return it->second.vars != 0;
+}
+
+// pushes the frame of a scope if it needs one
+static bool enter_scope(const Stmt* s){
+	size_t bytes;
+	if(!scope_frame(s, &bytes)) return false;
+	add_stack_frame(bytes);
+	return true;
+}
+
+// Mirrors the frames exec_stmt pushes, numbering each variable in the order
+// exec_decl will add it. Declarations directly in a switch body can be
+// jumped over, so those are left to be found by name.
+static void resolve_scope(const Stmt* s, unsigned depth, unsigned* num, bool ordered){
+	if(s == nullptr) return;
+
+	if(isa<CompoundStmt>(s)){
+		const CompoundStmt* stmt = (const CompoundStmt*)s;
+		size_t bytes;
+		unsigned d = scope_frame(s, &bytes) ? depth+1 : depth;
+		unsigned inner = 0;
+		for(auto it = stmt->body_begin(); it != stmt->body_end(); it++){
+			resolve_scope(*it, d, &inner, true);
+		}
+	} else if(isa<DeclStmt>(s)){
+		const DeclStmt* stmt = (const DeclStmt*)s;
+		for(auto it = stmt->decl_begin(); it != stmt->decl_end(); it++){
+			if(!isa<VarDecl>(*it)) continue;
+			if(ordered){
+				var_slots.insert(std::make_pair((const ValueDecl*)*it, var_slot(depth, *num)));
+			}
+			(*num)++;
+		}
+	} else if(isa<ForStmt>(s)){
+		const ForStmt* stmt = (const ForStmt*)s;
+		size_t bytes;
+		unsigned d = scope_frame(s, &bytes) ? depth+1 : depth;
+		unsigned inner = 0;
+		resolve_scope(stmt->getInit(), d, &inner, true);
+		resolve_scope(stmt->getBody(), d, &inner, true);
+	} else if(isa<IfStmt>(s)){
+		const IfStmt* stmt = (const IfStmt*)s;
+		resolve_scope(stmt->getThen(), depth, num, ordered);
+		resolve_scope(stmt->getElse(), depth, num, ordered);
+	} else if(isa<SwitchStmt>(s)){
+		const Stmt* body = ((const SwitchStmt*)s)->getBody();
+		size_t bytes;
+		unsigned d = scope_frame(s, &bytes) ? depth+1 : depth;
+		unsigned inner = 0;
+		if(isa<CompoundStmt>(body)){
+			const CompoundStmt* stmt = (const CompoundStmt*)body;
+			for(auto it = stmt->body_begin(); it != stmt->body_end(); it++){
+				resolve_scope(*it, d, &inner, false);
+			}
+		}
+	} else if(isa<SwitchCase>(s)){
+		resolve_scope(((const SwitchCase*)s)->getSubStmt(), depth, num, ordered);
+	}
+}
+
+// arguments are in the frame at depth 0, the body's frames start at 1
+static void resolve_function(const FunctionDecl* f){
+	if(!resolved_functions.insert(f).second) return;
+	for(unsigned i = 0; i < f->getNumParams(); i++){
+		var_slots.insert(std::make_pair((const ValueDecl*)f->getParamDecl(i), var_slot(0, i)));
+	}
+	unsigned num = 0;
+	resolve_scope(f->getBody(), 0, &num, true);
+}
+
+// whether the variable is found through var_slots, so it needn't be by name
+static bool has_stack_slot(const ValueDecl* d){
+	const auto it = var_slots.find(d);
+	return it != var_slots.end() && !it->second.global;
+}
+
+// finds a variable of the current function on the stack
+static bool find_stack_var(const ValueDecl* d, unsigned* level, unsigned* num){
+	const auto it = var_slots.find(d);
+	if(it != var_slots.end() && !it->second.global){
+		size_t l = frame_base + it->second.depth;
+		if(l < stack_vars.size() && it->second.num < stack_vars[l].size()){
+			*level = l;
+			*num = it->second.num;
+			return true;
+		}
+		// it was never added by name, so a lookup by name could only find
+		// some other variable
+		err_exit("Local variable isn't on the stack where it should be");
+	}
+	const auto ret = stack_var_map.find(d->getNameAsString());
+	if(ret == stack_var_map.end()){
+		return false;
+	}
+	const auto item = ret->second.back();
+	*level = item.first;
+	*num = item.second;
+	return true;
+}
+
+// what a call site called last time; a call straight to a named function
+// always goes to the same place, so it never needs the callee evaluated again
+class call_target{
+public:
+	bool direct;
+	uint32_t fid;
+	int source;
+	const FunctionDecl* defn; // null for external functions
+};
+
+static llvm::DenseMap<const CallExpr*, call_target> call_cache;
+
+static bool is_direct_callee(const Expr* callee){
+	while(isa<ImplicitCastExpr>(callee) || isa<ParenExpr>(callee)){
+		if(isa<ParenExpr>(callee)){
+			callee = ((const ParenExpr*)callee)->getSubExpr();
+		} else {
+			const ImplicitCastExpr* cast = (const ImplicitCastExpr*)callee;
+			if(cast->getCastKind() != CK_FunctionToPointerDecay && cast->getCastKind() != CK_BuiltinFnToFnPtr){
+				return false;
+			}
+			callee = cast->getSubExpr();
+		}
+	}
+	return isa<DeclRefExpr>(callee) && isa<FunctionDecl>(((const DeclRefExpr*)callee)->getDecl());
+}
+
+llvm::DenseMap<const CallExpr*, const EmuVal*>* call_results = nullptr;
+
+static llvm::cl::opt<unsigned> MaxCallDepth("max-call-depth", llvm::cl::desc("Deepest the emulated program may recurse before it is stopped with a stack overflow"), llvm::cl::init(1000), llvm::cl::cat(MyHelp));
+
+static unsigned call_depth = 0;
+
+const FunctionDecl* enter_call(const CallExpr* expr, const EmuVal** retval, saved_call* saved){
+	const Expr* const* args = expr->getArgs();
+	const Expr* callee = expr->getCallee();
+
+	// copied out, as calls made while evaluating the arguments can grow the cache
+	call_target target;
+	const auto cached = call_cache.find(expr);
+	bool hit = (cached != call_cache.end());
+	if(hit){
+		target = cached->second;
+	}
+	uint32_t fid;
+	if(hit && target.direct){
+		fid = target.fid;
+	} else {
+		const EmuVal* f = eval_rexpr(callee);
+		if(f->status != STATUS_DEFINED || !f->obj_type->isFunctionPointerType()){
+			f->obj_type.dump();
+			err_exit("Calling an invalid function");
+		}
+
+		const EmuPtr* p = (const EmuPtr*)f;
+		if(p->u.block->memtype == MEM_TYPE_EXTERN){
+			err_exit("Tried to call an unimplemented function");
+		}
+
+		const EmuFunc* func = (const EmuFunc*)from_lvalue(lvalue(p->u.block, ((const PointerType*)p->obj_type.getTypePtr())->getPointeeType(), p->offset));
+		if(func->status != STATUS_DEFINED){
+			err_exit("Calling an invalid function");
+		}
+		fid = func->func_id;
+		delete func;
+		delete f;
+
+		if(!hit || target.fid != fid){
+			// first call here, or an indirect call that went somewhere new
+			target.direct = is_direct_callee(callee);
+			target.fid = fid;
+			target.source = -1;
+			target.defn = nullptr;
+			if(fid >= NUM_EXTERNAL_FUNCTIONS){
+				const auto it = global_functions.find(fid);
+				target.source = it->second.first;
+				target.defn = (const FunctionDecl*)it->second.second;
+			}
+			call_cache[expr] = target;
+		}
+	}
+
+	// the arguments are worked out first, so their frame can be sized to fit them
+	std::vector<const EmuVal*> vals(expr->getNumArgs());
+	size_t bytes = 0;
+	if(fid < NUM_EXTERNAL_FUNCTIONS && is_lvalue_based_macro(fid)){
+		// special handling for va_args stuff
+		for(unsigned int i=0; i < expr->getNumArgs(); i++){
+			const Expr* arg = args[i];
+			while(isa<ImplicitCastExpr>(arg)){
+				arg = ((const ImplicitCastExpr*)arg)->getSubExpr();
+			}
+			if(!isa<DeclRefExpr>(arg)){
+				err_exit("Passed non-variable as lvalue to builtin macro");
+			}
+			unsigned level, num;
+			if(!find_stack_var(((const DeclRefExpr*)arg)->getDecl(), &level, &num)){
+				err_exit("Can't find appropriate lvalue for macro");
+			}
+			vals[i] = new EmuStackPos(level, num);
+		}
+	} else {
+		if(fid >= NUM_EXTERNAL_FUNCTIONS && call_depth >= MaxCallDepth){
+			err_exit("Stack overflow");
+		}
+		for(unsigned int i=0; i < expr->getNumArgs(); i++){
+			vals[i] = eval_rexpr(args[i]);
+			bytes += local_space(vals[i]->size());
+		}
+	}
+
+	size_t callee_base = stack_vars.size();
+	add_stack_frame(bytes);
+	if(fid < NUM_EXTERNAL_FUNCTIONS){
+		// we are dealing with an external function
+		for(unsigned int i=0; i < expr->getNumArgs(); i++){
+			mem_block* storage = new_local(vals[i]);
+			add_stack_var("", lvalue(storage,vals[i]->obj_type,0), false);
+			delete vals[i];
+		}
+		*retval = call_external(fid);
+		EMU_LOG(LOG_CALL, LOG_LEVEL_TRACE) << "DOUG DEBUG: popping frame leaving call\n";
+		pop_stack_frame();
+		return nullptr;
+	}
+
+	const FunctionDecl* defn = target.defn;
+	for(unsigned int i=0; i < expr->getNumArgs(); i++){
+		const EmuVal* val = vals[i];
+		mem_block* storage = new_local(val);
+		std::string name;
+		if(i >= defn->getNumParams()){
+			name = ""; // relevant for later args of e.g. printf(char*, ...)
+		} else {
+			name = defn->getParamDecl(i)->getNameAsString();
+		}
+		EMU_LOG(LOG_CALL, LOG_LEVEL_TRACE) << "DOUG DEBUG: adding stack variable "<<name<<" for arg "<<i<<" of internal function call (numparams="<< defn->getNumParams() <<")\n";
+
+		// parameters all have slots once resolve_function has run below
+		add_stack_var(name, lvalue(storage,val->obj_type,0), false);
+		delete val;
+	}
+
+	resolve_function(defn);
+	saved->source = curr_source;
+	saved->base = frame_base;
+	curr_source = target.source;
+	frame_base = callee_base;
+	call_depth++;
+	return defn;
+}
+
+void leave_call(const saved_call* saved){
+	call_depth--;
+	curr_source = saved->source;
+	frame_base = saved->base;
+	EMU_LOG(LOG_CALL, LOG_LEVEL_TRACE) << "DOUG DEBUG: popping frame leaving call\n";
+	pop_stack_frame();
+}
+
+// Integer expressions Clang can evaluate without side effects are run through
+// eval_rexpr once, so emulated sizes and widths still apply, and copies of the
+// result are handed out after that. Null for nodes that aren't constant.
+static llvm::DenseMap<const Expr*, const EmuVal*> const_values;
+static bool folding = false;
+
+static bool has_call(const Stmt* s){
+	if(s == nullptr) return false;
+	if(isa<CallExpr>(s)) return true;
+	for(auto it = s->child_begin(); it != s->child_end(); it++){
+		if(has_call(*it)) return true;
+	}
+	return false;
+}
+
+// null if e isn't constant
+// caller must free returned if not null
+static const EmuVal* eval_const(const Expr* e){
+	const auto it = const_values.find(e);
+	if(it != const_values.end()){
+		const EmuVal* val = it->second;
+		if(val == nullptr) return nullptr;
+		return val->cast_to(val->obj_type);
+	}
+
+	// calls are left alone, as the bytecode VM makes those ahead of time
+	if(!e->getType()->isIntegerType() || has_call(e) || !e->isEvaluatable(*sources[curr_source])){
+		const_values.insert(std::make_pair(e, (const EmuVal*)nullptr));
+		return nullptr;
+	}
+	folding = true;
+	const EmuVal* ans = eval_rexpr(e);
+	folding = false;
+	if(ans->status != STATUS_DEFINED){
+		const_values.insert(std::make_pair(e, (const EmuVal*)nullptr));
+		return ans;
+	}
+	const_values.insert(std::make_pair(e, ans));
+	return ans->cast_to(ans->obj_type);
+}
+
+// Each string literal gets a single static block the first time it is used,
+// shared with any other literal with the same contents.
+static llvm::DenseMap<const StringLiteral*, mem_block*> literal_blocks;
+static std::unordered_map<std::string, mem_block*> string_blocks;
+
+static mem_block* string_block(const StringLiteral* obj){
+	const auto it = literal_blocks.find(obj);
+	if(it != literal_blocks.end()) return it->second;
+
+	if(obj->getKind() != StringLiteral::StringKind::Ascii){
+		err_exit("Can't handle non-ascii strings");
+	}
+	std::string contents = obj->getString().str();
+	mem_block* stringstorage;
+	const auto it2 = string_blocks.find(contents);
+	if(it2 != string_blocks.end()){
+		stringstorage = it2->second;
+	} else {
+		stringstorage = new mem_block(MEM_TYPE_STATIC, contents.size()+1);
+		memcpy(stringstorage->data, contents.c_str(), contents.size()+1);
+		for(size_t i = 0; i < contents.size()+1; i++){
+			write_tag(stringstorage->at(i), 1, TAG_CHAR);
+		}
+		string_blocks.insert(std::make_pair(contents, stringstorage));
+	}
+	literal_blocks.insert(std::make_pair(obj, stringstorage));
+	return stringstorage;
+}
+
+// one static block for each builtin function a pointer is taken to, by name
+static std::unordered_map<std::string, mem_block*> builtin_blocks;
+
+static mem_block* builtin_block(const DeclRefExpr* ref){
+	std::string name = ref->getDecl()->getNameAsString();
+	const auto it = builtin_blocks.find(name);
+	if(it != builtin_blocks.end()) return it->second;
+
+	const EmuFunc* f = get_external_func(name, ref->getType());
+	mem_block* block = new mem_block(MEM_TYPE_STATIC, f);
+	delete f;
+	builtin_blocks.insert(std::make_pair(name, block));
+	return block;
+}
+
+// static blocks hold string literals and functions, which can't be changed
+static void check_writable(const lvalue& l){
+	if(l.ptr.block != nullptr && l.ptr.block->memtype == MEM_TYPE_STATIC){
+		err_exit("Attempted write to read-only memory");
+	}
+}
+
+// a pointer to a block that has died says why, before anything is read from
+// it; once the pointer is deleted, the block may be too
+static void check_dangling(const EmuPtr* p){
+	if(p->status == STATUS_UNDEFINED && p->u.repr.type_id == EMU_TYPE_PTR_ID){
+		err_exit(active_mem.gone_reason(p->u.repr.block_id).c_str());
+	}
+	if(p->status == STATUS_DEFINED && p->u.block != nullptr && p->u.block->memtype == MEM_TYPE_FREED){
+		err_exit(active_mem.gone_reason(p->u.block->id).c_str());
+	}
+}
+
 lvalue eval_lexpr(const Expr* e){
 	if(isa<DeclRefExpr>(e)){
-		const DeclRefExpr* expr = (const DeclRefExpr*)e;
-		std::string name = expr->getDecl()->getNameAsString();
-		const auto ret = stack_var_map.find(name);
-		if(ret == stack_var_map.end()){
-			return get_nonstack_var(name);			
-		}
-		const auto list = &ret->second;
-		const auto item = list->back();
-		lvalue ans = stack_vars[item.first][item.second].second;
+		const ValueDecl* d = ((const DeclRefExpr*)e)->getDecl();
+		const auto it = var_slots.find(d);
+		if(it != var_slots.end() && it->second.global){
+			return it->second.loc;
+		}
+		unsigned level, num;
+		if(find_stack_var(d, &level, &num)){
+			return stack_vars[level][num].second;
+		}
+		lvalue ans = get_nonstack_var(d->getNameAsString());
+		if(ans.ptr.block != nullptr){
+			var_slots.insert(std::make_pair(d, var_slot(ans)));
+		}
 		return ans;
 	} else if(isa<ArraySubscriptExpr>(e)){
 		const ArraySubscriptExpr* expr = (const ArraySubscriptExpr*)e;
 		const EmuVal* base = eval_rexpr(expr->getBase());
 		const EmuVal* idx = eval_rexpr(expr->getIdx());
-		const Type* basetype = base->obj_type.getCanonicalType().getTypePtr();
-		if(!basetype->isPointerType()){
+		const type_entry* basetype = type_lookup(base->obj_type);
+		if(basetype->kind != TYPE_KIND_PTR){
 			llvm::errs() << "\n\n";
-			basetype->dump();
+			basetype->type.dump();
 			cant_handle();
 		}
-		QualType t = idx->obj_type.getCanonicalType();
-		if(!t->isIntegerType()){
+		if(type_lookup(idx->obj_type)->kind != TYPE_KIND_NUM){
 			llvm::errs() << "\n\n";
-			t.dump();
+			idx->obj_type.dump();
 			cant_handle();
 		}
 		const EmuPtr* emup = (const EmuPtr*)base;
+		check_dangling(emup);
 		mem_ptr p = mem_ptr(emup->u.block, emup->offset);
-		QualType subtype = ((const PointerType*)basetype)->getPointeeType();
+		QualType subtype = base->obj_type->getPointeeType();
 
-		const llvm::APInt idx_val = ((const EmuNumGeneric*)idx)->val;
-		int64_t offset = ((int64_t)getSizeOf(subtype))*idx_val.getSExtValue() + p.offset;
+		int64_t offset = ((int64_t)getSizeOf(subtype))*((const EmuNumGeneric*)idx)->sext() + p.offset;
 		
 		if(offset<0){
 			err_exit("Got pointer to invalid location");
 		}
-		return lvalue(p.block, ((const PointerType*)basetype)->getPointeeType(), (size_t)offset);
+		return lvalue(p.block, subtype, (size_t)offset);
+	} else if(isa<MemberExpr>(e)){
+		const MemberExpr* expr = (const MemberExpr*)e;
+		const FieldDecl* field = dyn_cast<FieldDecl>(expr->getMemberDecl());
+		if(field == nullptr){
+			e->dump();
+			cant_handle();
+		}
+		mem_ptr base(nullptr, 0);
+		if(expr->isArrow()){
+			const EmuVal* ptr = eval_rexpr(expr->getBase());
+			const EmuPtr* p = (const EmuPtr*)ptr;
+			check_dangling(p);
+			if(p->status != STATUS_DEFINED || p->u.block == nullptr){
+				err_exit("Dereferenced invalid pointer");
+			}
+			base = mem_ptr(p->u.block, p->offset);
+			delete ptr;
+		} else {
+			base = eval_lexpr(expr->getBase()).ptr;
+		}
+		const record_layout* layout = get_layout(field->getParent());
+		return lvalue(base.block, expr->getType(), base.offset + layout->offsets[field->getFieldIndex()]);
 	} else if(isa<StringLiteral>(e)){
 		const StringLiteral *obj = (const StringLiteral*)e;
 		if(obj->getKind() != StringLiteral::StringKind::Ascii){
 			err_exit("Can't handle non-ascii strings");
 		}
-		// allocate string at this point
-		mem_block *stringstorage = new mem_block(MEM_TYPE_STATIC, obj->getByteLength()+1);
-		for(unsigned int i = 0; i <= obj->getLength(); i++){
-			char c;
-			if(i < obj->getLength()) c = (char)obj->getCodeUnit(i);
-			else c = '\0';
-			((char*)stringstorage->data)[i] = c;
-		}
-		return lvalue(stringstorage, e->getType(), 0);
+		return lvalue(string_block(obj), e->getType(), 0);
 	} else if(isa<ParenExpr>(e)){
 		return eval_lexpr(((const ParenExpr*)e)->getSubExpr());
 	}
@@ -102,10 +589,76 @@ lvalue eval_lexpr(const Expr* e){
 	cant_handle();
 }
 
-// caller must free returned value
-const EmuVal* eval_rexpr(const Expr* e){
-	errs() << "\nDEBUG: about to eval rexpr:\n";
-	e->dump();
+// the integer expressions eval_num works out itself; eval_rexpr hands these
+// to it and boxes the result
+static bool is_num_expr(const Expr* e){
+	if(!e->getType()->isIntegerType()) return false;
+	if(isa<IntegerLiteral>(e) || isa<CharacterLiteral>(e) || isa<ParenExpr>(e)){
+		return true;
+	} else if(isa<UnaryOperator>(e)){
+		switch(((const UnaryOperator*)e)->getOpcode()){
+		case UO_LNot:
+		case UO_Minus:
+		case UO_PostInc:
+		case UO_PostDec:
+		case UO_PreInc:
+		case UO_PreDec:
+			return true;
+		default:
+			return false;
+		}
+	} else if(isa<BinaryOperator>(e)){
+		switch(((const BinaryOperator*)e)->getOpcode()){
+		case BO_Assign:
+		case BO_LT:
+		case BO_GT:
+		case BO_LE:
+		case BO_GE:
+		case BO_EQ:
+		case BO_NE:
+		case BO_AddAssign:
+		case BO_SubAssign:
+		case BO_Add:
+		case BO_Sub:
+		case BO_Mul:
+		case BO_Div:
+		case BO_And:
+		case BO_Or:
+			return true;
+		default:
+			return false;
+		}
+	} else if(isa<CastExpr>(e)){
+		switch(((const CastExpr*)e)->getCastKind()){
+		case CK_LValueToRValue:
+		case CK_NoOp:
+		case CK_IntegralCast:
+			return true;
+		default:
+			return false;
+		}
+	}
+	return false;
+}
+
+// an int read from an lvalue for ++, -- and the compound assignments
+static emu_num load_int(const lvalue& l){
+	size_t space = l.ptr.block->size;
+	if(space < 4 || space-4 < l.ptr.offset){
+		bad_memread();
+	}
+	const EmuNum<NUM_TYPE_INT> value(l.ptr.block->at(l.ptr.offset), space-l.ptr.offset);
+	return emu_num(value.status, NUM_TYPE_INT, value.raw);
+}
+
+// eval_num once constants have been looked for
+static emu_num eval_num_expr(const Expr* e){
+	if(!is_num_expr(e)){
+		const EmuVal* v = eval_rexpr(e);
+		emu_num ans(v);
+		delete v;
+		return ans;
+	}
 
 	if(isa<IntegerLiteral>(e)){
 		const IntegerLiteral *obj = (const IntegerLiteral*)e;
@@ -114,7 +667,7 @@ const EmuVal* eval_rexpr(const Expr* e){
 			e->dump();
 			cant_handle();
 		}
-		return new EmuNum<NUM_TYPE_INT>(i);
+		return emu_num(STATUS_DEFINED, NUM_TYPE_INT, (uint64_t)i.getSExtValue());
 	} else if(isa<CharacterLiteral>(e)){
 		const CharacterLiteral *obj = (const CharacterLiteral*)e;
 		unsigned int i = obj->getValue();
@@ -122,40 +675,182 @@ const EmuVal* eval_rexpr(const Expr* e){
 			e->dump();
 			cant_handle();
 		}
-		return new EmuNum<NUM_TYPE_CHAR>(new APInt(8, i, true));
+		return emu_num(STATUS_DEFINED, NUM_TYPE_CHAR, i);
+	} else if(isa<ParenExpr>(e)){
+		return eval_num(((const ParenExpr*)e)->getSubExpr());
 	} else if(isa<UnaryOperator>(e)){
 		const UnaryOperator *obj = (const UnaryOperator*)e;
 		const Expr* sub = obj->getSubExpr();
-		const auto op = obj->getOpcode();
+		if(obj->isIncrementDecrementOp()){
+			// ints only, like +=
+			lvalue arg = eval_lexpr(sub);
+			check_writable(arg);
+			if(arg.type.getCanonicalType() != IntType){
+				arg.type.dump();
+				cant_handle();
+			}
+			emu_num value = load_int(arg);
+			const emu_num one(STATUS_DEFINED, NUM_TYPE_INT, 1);
+			emu_num result = obj->isIncrementOp() ? value.add(one) : value.sub(one);
+			result.store(arg.ptr.block, arg.ptr.offset);
+			return obj->isPrefix() ? result : value;
+		}
+		emu_num arg = eval_num(sub);
+		return (obj->getOpcode() == UO_LNot) ? arg.lnot() : arg.neg();
+	} else if(isa<BinaryOperator>(e)){
+		const BinaryOperator* ex = (const BinaryOperator*)e;
+		BinaryOperatorKind op = ex->getOpcode();
+
+		// right always first, as in eval_rexpr
+		const Expr* rhs = ex->getRHS();
+		emu_num right = eval_num(rhs);
 		switch(op){
-		case UO_AddrOf:
+		case BO_Assign:
 		{
-			lvalue arg = eval_lexpr(sub);
-			return new EmuPtr(arg.ptr, e->getType());
+			lvalue left = eval_lexpr(ex->getLHS());
+			check_writable(left);
+			emu_num ans = right.cast_to(left.type);
+			ans.store(left.ptr.block, left.ptr.offset);
+			return ans;
 		}
-		case UO_LNot:
-		case UO_Minus:
+		case BO_LT:
+		case BO_GT:
+		case BO_LE:
+		case BO_GE:
+		case BO_EQ:
+		case BO_NE:
 		{
-			const EmuVal* arg = eval_rexpr(sub);
-			if(!arg->obj_type->isIntegerType()){
-				cant_cast();
+			emu_num left = eval_num(ex->getLHS());
+			if(left.type != NUM_TYPE_INT || right.type != NUM_TYPE_INT){
+				ex->getLHS()->getType().dump();
+				rhs->getType().dump();
+				cant_handle();
+			}
+			int64_t lval = left.sext();
+			int64_t rval = right.sext();
+			int ans;
+			if(op == BO_LT)    ans = (lval <  rval)?1:0;
+			else if(op==BO_GT) ans = (lval >  rval)?1:0;
+			else if(op==BO_LE) ans = (lval <= rval)?1:0;
+			else if(op==BO_GE) ans = (lval >= rval)?1:0;
+			else if(op==BO_EQ) ans = (lval == rval)?1:0;
+			else               ans = (lval != rval)?1:0;
+			return emu_num(STATUS_DEFINED, NUM_TYPE_INT, ans);
+		}
+		case BO_AddAssign:
+		case BO_SubAssign:
+		{
+			lvalue left = eval_lexpr(ex->getLHS());
+			check_writable(left);
+			if(left.type.getCanonicalType() != IntType || right.type != NUM_TYPE_INT){
+				left.type.dump();
+				rhs->getType().dump();
+				cant_handle();
 			}
-			if(op == UO_LNot){
-				return ((const EmuNumGeneric*)arg)->lnot();
-			} else if (op == UO_Minus){
-				return ((const EmuNumGeneric*)arg)->neg();
+			emu_num value = load_int(left);
+			emu_num result = (op == BO_AddAssign) ? value.add(right) : value.sub(right);
+			result.store(left.ptr.block, left.ptr.offset);
+			return result;
+		}
+		default:
+		{
+			emu_num left = eval_num(ex->getLHS());
+			if(op == BO_Add) return left.add(right);
+			if(op == BO_Sub) return left.sub(right);
+			if(op == BO_Mul) return left.mul(right);
+			if(op == BO_Div) return left.div(right);
+			if(op == BO_Or)  return left._or(right);
+			return left._and(right);
+		}
+		}
+	}
+
+	// casts
+	const CastExpr* expr = (const CastExpr*)e;
+	const Expr* sub = expr->getSubExpr();
+	switch(expr->getCastKind()){
+	case CK_LValueToRValue:
+		return load_num(eval_lexpr(sub));
+	case CK_IntegralCast:
+		return eval_num(sub).cast_to(expr->getType());
+	default: // CK_NoOp
+		return eval_num(sub);
+	}
+}
+
+emu_num eval_num(const Expr* e){
+	if(!folding){
+		const auto it = const_values.find(e);
+		if(it != const_values.end()){
+			if(it->second != nullptr) return emu_num(it->second);
+		} else {
+			const EmuVal* folded = eval_const(e);
+			if(folded != nullptr){
+				emu_num ans(folded);
+				delete folded;
+				return ans;
 			}
 		}
+	}
+	return eval_num_expr(e);
+}
+
+bool expr_is_zero(const Expr* e){
+	if(!e->getType()->isIntegerType()){
+		const EmuVal* v = eval_rexpr(e);
+		bool z = is_scalar_zero(v);
+		delete v;
+		return z;
+	}
+	emu_num n = eval_num(e);
+	if(n.type != NUM_TYPE_INT) cant_handle();
+	return n.raw == 0;
+}
+
+void eval_discard(const Expr* e){
+	if(e->getType()->isIntegerType()){
+		eval_num(e);
+	} else {
+		delete eval_rexpr(e);
+	}
+}
+
+// caller must free returned value
+const EmuVal* eval_rexpr(const Expr* e){
+	if(EMU_LOG_ON(LOG_EVAL, LOG_LEVEL_TRACE)){
+		llvm::errs() << "\nDEBUG: about to eval rexpr:\n";
+		e->dump();
+	}
+
+	if(!folding){
+		const EmuVal* folded = eval_const(e);
+		if(folded != nullptr) return folded;
+	}
+
+	if(is_num_expr(e)){
+		return eval_num_expr(e).box();
+	}
+
+	if(isa<UnaryOperator>(e)){
+		const UnaryOperator *obj = (const UnaryOperator*)e;
+		const Expr* sub = obj->getSubExpr();
+		const auto op = obj->getOpcode();
+		switch(op){
+		case UO_AddrOf:
+		{
+			lvalue arg = eval_lexpr(sub);
+			return new EmuPtr(arg.ptr, e->getType());
+		}
 		case UO_Deref:
 		case UO_Extension:
 		case UO_Imag:
 		case UO_Real:
 		case UO_Not:
+		case UO_Plus:
 		case UO_PostInc:
 		case UO_PostDec:
 		case UO_PreInc:
 		case UO_PreDec:
-		case UO_Plus:
 		default:
 			llvm::errs() << "Got opcode " << obj->getOpcode() << "\n";
 			cant_handle();
@@ -171,79 +866,12 @@ const EmuVal* eval_rexpr(const Expr* e){
 		case BO_Assign:
 		{
 			lvalue left = eval_lexpr(ex->getLHS());
+			check_writable(left);
 			const EmuVal* ans = right->cast_to(left.type);
 			delete right;
 			left.ptr.block->write(ans, left.ptr.offset);
 			return ans;
 		}
-		case BO_LT:
-		case BO_GT:
-		case BO_LE:
-		case BO_GE:
-		case BO_EQ:
-		case BO_NE:
-		{
-			const EmuVal *left = eval_rexpr(ex->getLHS());
-			QualType tl = left->obj_type.getCanonicalType();
-			QualType tr = right->obj_type.getCanonicalType();
-			if(tl != IntType || tr != IntType){
-				left->obj_type.dump();
-				right->obj_type.dump();
-				cant_handle();
-			}
-			const llvm::APInt* lval = &((const EmuNum<NUM_TYPE_INT>*)left)->val;
-			llvm::APInt rval = ((const EmuNum<NUM_TYPE_INT>*)right)->val;
-			int ans;
-			if(lval->isNegative()){
-				if(op == BO_LT)    ans = (lval->slt(rval))?1:0;
-				else if(op==BO_GT) ans = (lval->sgt(rval))?1:0;
-				else if(op==BO_LE) ans = (lval->sle(rval))?1:0;
-				else if(op==BO_GE) ans = (lval->sge(rval))?1:0;
-				else if(op==BO_EQ) ans = (lval->eq( rval))?1:0;
-				else if(op==BO_NE) ans = (lval->ne( rval))?1:0;
-			} else if(rval.isNegative()){
-				if(op == BO_LT)    ans = 0;
-				else if(op==BO_GT) ans = 1;
-				else if(op==BO_LE) ans = 0;
-				else if(op==BO_GE) ans = 1;
-				else if(op==BO_EQ) ans = 0;
-				else if(op==BO_NE) ans = 1;
-			} else {
-				if(op == BO_LT)    ans = (lval->ult(rval))?1:0;
-				else if(op==BO_GT) ans = (lval->ugt(rval))?1:0;
-				else if(op==BO_LE) ans = (lval->ule(rval))?1:0;
-				else if(op==BO_GE) ans = (lval->uge(rval))?1:0;
-				else if(op==BO_EQ) ans = (lval->eq( rval))?1:0;
-				else if(op==BO_NE) ans = (lval->ne( rval))?1:0;
-			}
-			delete left;
-			delete right;
-			return new EmuNum<NUM_TYPE_INT>(APInt(32, apint_signed_repr(ans), true));
-		}
-		case BO_AddAssign:
-		case BO_SubAssign:
-		{
-			lvalue left = eval_lexpr(ex->getLHS());
-			QualType tl = left.type.getCanonicalType();
-			QualType tr = right->obj_type.getCanonicalType();
-			if(tl != IntType || tr != IntType){
-				left.type.dump();
-				right->obj_type.dump();
-				cant_handle();
-			}
-			void* ptr = &((char*)left.ptr.block->data)[left.ptr.offset];
-			size_t space = left.ptr.block->size;
-			if(space < 4 || space-4 < left.ptr.offset){
-				bad_memread();
-			}
-			const EmuNum<NUM_TYPE_INT> value(ptr);
-			const EmuNum<NUM_TYPE_INT>* result;
-			if(op == BO_AddAssign) result = value.add((const EmuNum<NUM_TYPE_INT>*)right);
-			else                   result = value.sub((const EmuNum<NUM_TYPE_INT>*)right);
-			left.ptr.block->write(result, left.ptr.offset);
-			delete right;
-			return result;
-		}
 		case BO_Add:
 		case BO_Sub:
 		case BO_Mul:
@@ -252,7 +880,7 @@ const EmuVal* eval_rexpr(const Expr* e){
 		case BO_Or:
 		{
 			const EmuVal* left = eval_rexpr(ex->getLHS());
-			if(!right->obj_type->isIntegerType()){
+			if(type_lookup(right->obj_type)->kind != TYPE_KIND_NUM){
 				right->obj_type.dump();
 				cant_cast();
 			}
@@ -260,27 +888,19 @@ const EmuVal* eval_rexpr(const Expr* e){
 			const EmuVal* retval;
 
 			QualType tl = left->obj_type;
+			const type_entry* lt = type_lookup(tl);
 			// special case: add integer to pointer
-			if(tl->isPointerType()){
+			if(lt->kind == TYPE_KIND_PTR){
 				int n;
-				if(op == BO_Add) n = trueright->val.getSExtValue();
-				else if(op == BO_Sub) n = -trueright->val.getSExtValue();
+				if(op == BO_Add) n = trueright->sext();
+				else if(op == BO_Sub) n = -trueright->sext();
 				else err_exit("Undefined op on pointer");
 				
-				QualType sub = tl->getAs<PointerType>()->getPointeeType();
-				int s = getSizeOf(sub);
+				int s = getSizeOf(type_at(lt->sub)->type);
 				const EmuPtr* lp = (const EmuPtr*)left;
 				retval = new EmuPtr(mem_ptr(lp->u.block,lp->offset+n*s), tl);
-			} else if(tl->isIntegerType()){
-				const EmuNumGeneric* trueleft = (const EmuNumGeneric*)left;
-				if(op == BO_Add)      retval = trueleft->add(trueright);
-				else if(op == BO_Sub) retval = trueleft->sub(trueright);
-				else if(op == BO_Mul) retval = trueleft->mul(trueright);
-				else if(op == BO_Div) retval = trueleft->div(trueright);
-				else if(op == BO_Or) retval = trueleft->_or(trueright);
-				else if(op == BO_And)retval = trueleft->_and(trueright);
-				else cant_cast();
 			} else {
+				// numbers are left to eval_num
 				tl.dump();
 				cant_cast();
 			}
@@ -290,6 +910,14 @@ const EmuVal* eval_rexpr(const Expr* e){
 
 			return retval;
 		}
+		case BO_LT:
+		case BO_GT:
+		case BO_LE:
+		case BO_GE:
+		case BO_EQ:
+		case BO_NE:
+		case BO_AddAssign:
+		case BO_SubAssign:
 		case BO_PtrMemD:
 		case BO_PtrMemI:
 		case BO_Rem:
@@ -321,16 +949,17 @@ const EmuVal* eval_rexpr(const Expr* e){
 			return eval_rexpr(sub);
 		case CK_BitCast:
 		{
+			const EmuVal* val = eval_rexpr(sub);
+			const EmuVal* ans;
 			if(isa<ExplicitCastExpr>(e)){
 				const ExplicitCastExpr* expr = (const ExplicitCastExpr*)e;
-				return eval_rexpr(sub)->cast_to(expr->getTypeAsWritten());
+				ans = val->cast_to(expr->getTypeAsWritten());
+			} else {
+				// else ImplicitCastExpr
+				ans = val->cast_to(e->getType());
 			}
-			// else ImplicitCastExpr
-			return eval_rexpr(sub)->cast_to(e->getType());
-		}
-		case CK_IntegralCast:
-		{
-			return eval_rexpr(sub)->cast_to(expr->getType());
+			delete val;
+			return ans;
 		}
 		case CK_FunctionToPointerDecay:
 		{
@@ -352,11 +981,7 @@ const EmuVal* eval_rexpr(const Expr* e){
 			if(!isa<DeclRefExpr>(sub)){
 				err_exit("Don't know how to convert builtin function");
 			}
-			std::string name = ((const DeclRefExpr*)sub)->getDecl()->getNameAsString();
-			const EmuFunc* f = get_external_func(name, sub->getType());
-			mem_block* ptr = new mem_block(MEM_TYPE_STATIC, f);
-			delete f;
-			return new EmuPtr(mem_ptr(ptr,0), expr->getType());
+			return new EmuPtr(mem_ptr(builtin_block((const DeclRefExpr*)sub),0), expr->getType());
 		}
 		case CK_NullToPointer:
 		{
@@ -379,11 +1004,12 @@ const EmuVal* eval_rexpr(const Expr* e){
 			}
 			delete ptr;
 			if((expr->getType()->getAs<BuiltinType>())->isSignedInteger()){
-				return new EmuNum<NUM_TYPE_LONGLONG>(APInt(64, (segment << 32) + offset, true));
+				return new EmuNum<NUM_TYPE_LONGLONG>(STATUS_DEFINED, (segment << 32) + offset);
 			} else {
-				return new EmuNum<NUM_TYPE_ULONGLONG>(APInt(64, (segment << 32) + offset, false));				
+				return new EmuNum<NUM_TYPE_ULONGLONG>(STATUS_DEFINED, (segment << 32) + offset);				
 			}
 		}
+		case CK_IntegralCast: // always to a number, see eval_num
 		case CK_VectorSplat:
 		case CK_IntegralToBoolean:
 		case CK_IntegralToFloating:
@@ -426,92 +1052,27 @@ const EmuVal* eval_rexpr(const Expr* e){
 		}
 	} else if(isa<CallExpr>(e)){
 		const CallExpr* expr = (const CallExpr*)e;
-		const Expr* const* args = expr->getArgs();
-		const Expr* callee = expr->getCallee();
-
-		llvm::errs() << "DOUG DEBUG: executing the following call:\n";
-		callee->dump();
-
-		const EmuVal* f = eval_rexpr(callee);
-		if(f->status != STATUS_DEFINED || !f->obj_type->isFunctionPointerType()){
-			f->obj_type.dump();
-			err_exit("Calling an invalid function");
-		}
-
-		const EmuPtr* p = (const EmuPtr*)f;
-		if(p->u.block->memtype == MEM_TYPE_EXTERN){
-			err_exit("Tried to call an unimplemented function");
+		if(call_results != nullptr){
+			const auto it = call_results->find(expr);
+			if(it != call_results->end()){
+				const EmuVal* ans = it->second;
+				call_results->erase(it);
+				return ans;
+			}
 		}
 
-		const EmuFunc* func = (const EmuFunc*)from_lvalue(lvalue(p->u.block, ((const PointerType*)p->obj_type.getTypePtr())->getPointeeType(), p->offset));
-		uint32_t fid = func->func_id;
-		
 		const EmuVal* retval;
-
-		add_stack_frame();
-		if(fid < NUM_EXTERNAL_FUNCTIONS){
-			if(is_lvalue_based_macro(fid)){
-				// special handling for va_args stuff
-				for(unsigned int i=0; i < expr->getNumArgs(); i++){
-					const Expr* arg = args[i];
-					while(isa<ImplicitCastExpr>(arg)){
-						arg = ((const ImplicitCastExpr*)arg)->getSubExpr();
-					}
-					if(!isa<DeclRefExpr>(arg)){
-						err_exit("Passed non-variable as lvalue to builtin macro");
-					}
-					std::string name = ((const DeclRefExpr*)arg)->getDecl()->getNameAsString();
-					std::unordered_map<std::string,std::deque<std::pair<int,int> > >::const_iterator list = stack_var_map.find(name);
-					if(list == stack_var_map.end()){
-						err_exit("Can't find appropriate lvalue for macro");
-					}
-					const auto test = list->second;
-					const auto item = test.back();
-					const EmuVal* val = new EmuStackPos(item.first, item.second);
-					mem_block* storage = new mem_block(MEM_TYPE_STACK, val);
-					add_stack_var("", lvalue(storage,val->obj_type,0));
-					delete val;
-				}
+		saved_call saved;
+		const FunctionDecl* defn = enter_call(expr, &retval, &saved);
+		if(defn != nullptr){
+			if(UseBytecode){
+				retval = run_function(defn);
 			} else {
-				// we are dealing with an external function
-				for(unsigned int i=0; i < expr->getNumArgs(); i++){
-					const EmuVal* val = eval_rexpr(args[i]);
-					mem_block* storage = new mem_block(MEM_TYPE_STACK, val);
-					add_stack_var("", lvalue(storage,val->obj_type,0));
-					delete val;
-				}
-			}
-			retval = call_external(fid);
-		} else {
-			const auto it = global_functions.find(fid);
-			const FunctionDecl* defn = (const FunctionDecl*)it->second.second;
-
-			for(unsigned int i=0; i < expr->getNumArgs(); i++){
-				const EmuVal* val = eval_rexpr(args[i]);
-				mem_block* storage = new mem_block(MEM_TYPE_STACK, val);
-				std::string name;
-				if(i >= defn->getNumParams()){
-					name = ""; // relevant for later args of e.g. printf(char*, ...)
-				} else {
-					name = defn->getParamDecl(i)->getNameAsString();
-				}
-				llvm::errs() << "DOUG DEBUG: adding stack variable "<<name<<" for arg "<<i<<" of internal function call (numparams="<< defn->getNumParams() <<")\n";
-				defn->dump();
-				
-				add_stack_var(name, lvalue(storage,val->obj_type,0));
-				delete val;
+				retval = exec_stmt(defn->getBody());
 			}
-
-			int save = curr_source;
-			curr_source = it->second.first;
-			llvm::errs() << "DOUG DEBUG: actually executing:\n";
-			defn->getBody()->dump();
-			retval = exec_stmt(defn->getBody());
-			llvm::errs() << "DOUG DEBUG: call returned with retval at "<<((const void*)retval)<<"\n";
-			curr_source = save;
+			EMU_LOG(LOG_CALL, LOG_LEVEL_INFO) << "DOUG DEBUG: call returned with retval at "<<((const void*)retval)<<"\n";
+			leave_call(&saved);
 		}
-		llvm::errs() << "DOUG DEBUG: popping frame leaving call\n";
-		pop_stack_frame();
 		return retval;
 	} else if(isa<UnaryExprOrTypeTraitExpr>(e)){
 		const UnaryExprOrTypeTraitExpr* expr = (const UnaryExprOrTypeTraitExpr*)e;
@@ -519,10 +1080,16 @@ const EmuVal* eval_rexpr(const Expr* e){
 		case UETT_SizeOf:
 		{
 			QualType qt = expr->getArgumentType();
-			const EmuVal* fake = from_lvalue(lvalue(nullptr, qt, 0));
-			uint64_t thesize = (uint64_t)fake->size();
-			delete fake;
-			return new EmuNum<NUM_TYPE_ULONG>(APInt(32, thesize, false));
+			uint64_t thesize;
+			if(qt->isVariablyModifiedType()){
+				// the size expressions still have to be evaluated
+				const EmuVal* fake = from_lvalue(lvalue(nullptr, qt, 0));
+				thesize = (uint64_t)fake->size();
+				delete fake;
+			} else {
+				thesize = getValueSizeOf(qt);
+			}
+			return new EmuNum<NUM_TYPE_ULONG>(STATUS_DEFINED, thesize);
 		}
 		case UETT_AlignOf:
 		case UETT_VecStep:
@@ -558,11 +1125,282 @@ const EmuVal* eval_rexpr(const Expr* e){
 		return zero_init(e->getType());
 	} else if(isa<ParenExpr>(e)){
 		return eval_rexpr(((const ParenExpr*)e)->getSubExpr());
+	} else if(isa<MemberExpr>(e)){
+		// a member of a struct rvalue such as f().x; members of lvalues are
+		// loaded through eval_lexpr
+		const MemberExpr* expr = (const MemberExpr*)e;
+		const FieldDecl* field = dyn_cast<FieldDecl>(expr->getMemberDecl());
+		if(field == nullptr || expr->isArrow()){
+			e->dump();
+			cant_handle();
+		}
+		const EmuVal* base = eval_rexpr(expr->getBase());
+		const EmuVal* ans = ((const EmuStruct*)base)->member(get_layout(field->getParent()), field->getFieldIndex());
+		delete base;
+		return ans;
 	}
 	e->dump();
 	cant_handle();
 }
 
+// for(init; i < n; i++) and the like, where i is a local int only the loop
+// changes and n can't change while it runs. Those run on a native counter.
+static llvm::DenseMap<const ForStmt*, const counted_loop*> counted_loops;
+
+static const Expr* strip_expr(const Expr* e){
+	while(isa<ParenExpr>(e) || isa<ImplicitCastExpr>(e)){
+		if(isa<ParenExpr>(e)){
+			e = ((const ParenExpr*)e)->getSubExpr();
+		} else {
+			e = ((const ImplicitCastExpr*)e)->getSubExpr();
+		}
+	}
+	return e;
+}
+
+static bool refers_to(const Expr* e, const VarDecl* v){
+	e = strip_expr(e);
+	return isa<DeclRefExpr>(e) && ((const DeclRefExpr*)e)->getDecl() == v;
+}
+
+static bool addr_taken(const Stmt* s, const VarDecl* v){
+	if(s == nullptr) return false;
+	if(isa<UnaryOperator>(s) && ((const UnaryOperator*)s)->getOpcode() == UO_AddrOf && refers_to(((const UnaryOperator*)s)->getSubExpr(), v)) return true;
+	for(auto it = s->child_begin(); it != s->child_end(); it++){
+		if(addr_taken(*it, v)) return true;
+	}
+	return false;
+}
+
+static bool assigns(const Stmt* s, const VarDecl* v){
+	if(s == nullptr) return false;
+	if(isa<BinaryOperator>(s)){
+		const BinaryOperator* op = (const BinaryOperator*)s;
+		if((op->isAssignmentOp() || op->isCompoundAssignmentOp()) && refers_to(op->getLHS(), v)) return true;
+	} else if(isa<UnaryOperator>(s)){
+		const UnaryOperator* op = (const UnaryOperator*)s;
+		if(op->isIncrementDecrementOp() && refers_to(op->getSubExpr(), v)) return true;
+	}
+	for(auto it = s->child_begin(); it != s->child_end(); it++){
+		if(assigns(*it, v)) return true;
+	}
+	return false;
+}
+
+// a local int that only writes inside of s could change
+static bool is_private_int(const VarDecl* v, const Stmt* s){
+	if(!v->hasLocalStorage() || v->getType().getCanonicalType() != IntType) return false;
+	const DeclContext* ctx = v->getParentFunctionOrMethod();
+	if(ctx == nullptr || !isa<FunctionDecl>(ctx)) return false;
+	return !addr_taken(((const FunctionDecl*)ctx)->getBody(), v) && !assigns(s, v);
+}
+
+// arithmetic on literals and locals the loop can't change
+static bool is_invariant(const Expr* e, const ForStmt* loop){
+	e = strip_expr(e);
+	if(isa<IntegerLiteral>(e) || isa<CharacterLiteral>(e)){
+		return true;
+	} else if(isa<DeclRefExpr>(e)){
+		const ValueDecl* d = ((const DeclRefExpr*)e)->getDecl();
+		return isa<VarDecl>(d) && is_private_int((const VarDecl*)d, loop);
+	} else if(isa<BinaryOperator>(e)){
+		const BinaryOperator* op = (const BinaryOperator*)e;
+		switch(op->getOpcode()){
+		case BO_Add:
+		case BO_Sub:
+		case BO_Mul:
+		case BO_Div:
+			return is_invariant(op->getLHS(), loop) && is_invariant(op->getRHS(), loop);
+		default:
+			return false;
+		}
+	} else if(isa<UnaryOperator>(e)){
+		const UnaryOperator* op = (const UnaryOperator*)e;
+		return op->getOpcode() == UO_Minus && is_invariant(op->getSubExpr(), loop);
+	}
+	return false;
+}
+
+static const counted_loop* analyze_loop(const ForStmt* s){
+	const Expr* cond = s->getCond();
+	const Expr* inc = s->getInc();
+	if(cond == nullptr || inc == nullptr) return nullptr;
+
+	cond = strip_expr(cond);
+	if(!isa<BinaryOperator>(cond)) return nullptr;
+	const BinaryOperator* test = (const BinaryOperator*)cond;
+	switch(test->getOpcode()){
+	case BO_LT:
+	case BO_LE:
+	case BO_GT:
+	case BO_GE:
+	case BO_NE:
+		break;
+	default:
+		return nullptr;
+	}
+	const Expr* var = strip_expr(test->getLHS());
+	if(!isa<DeclRefExpr>(var) || !isa<VarDecl>(((const DeclRefExpr*)var)->getDecl())) return nullptr;
+	const VarDecl* v = (const VarDecl*)((const DeclRefExpr*)var)->getDecl();
+	if(test->getRHS()->getType().getCanonicalType() != IntType) return nullptr;
+
+	int32_t step;
+	inc = strip_expr(inc);
+	if(isa<UnaryOperator>(inc)){
+		const UnaryOperator* op = (const UnaryOperator*)inc;
+		if(!op->isIncrementDecrementOp() || !refers_to(op->getSubExpr(), v)) return nullptr;
+		step = op->isIncrementOp() ? 1 : -1;
+	} else if(isa<BinaryOperator>(inc)){
+		const BinaryOperator* op = (const BinaryOperator*)inc;
+		if(op->getOpcode() != BO_AddAssign && op->getOpcode() != BO_SubAssign) return nullptr;
+		if(!refers_to(op->getLHS(), v)) return nullptr;
+		const Expr* amount = strip_expr(op->getRHS());
+		if(!isa<IntegerLiteral>(amount) || ((const IntegerLiteral*)amount)->getValue() != 1) return nullptr;
+		step = (op->getOpcode() == BO_AddAssign) ? 1 : -1;
+	} else {
+		return nullptr;
+	}
+
+	if(!is_private_int(v, s->getBody()) || !is_invariant(test->getRHS(), s) || refers_to(test->getRHS(), v)) return nullptr;
+
+	counted_loop* ans = new counted_loop();
+	ans->var = var;
+	ans->cmp = test->getOpcode();
+	ans->bound = test->getRHS();
+	ans->step = step;
+	return ans;
+}
+
+// null if s doesn't have the right shape
+const counted_loop* find_counted_loop(const ForStmt* s){
+	const auto it = counted_loops.find(s);
+	if(it != counted_loops.end()) return it->second;
+	const counted_loop* ans = analyze_loop(s);
+	counted_loops.insert(std::make_pair(s, ans));
+	return ans;
+}
+
+// reads the counter and evaluates the bound, once the init has run
+bool start_counted_loop(const counted_loop* loop, loop_counter* ctr){
+	lvalue l = eval_lexpr(loop->var);
+	const EmuVal* val = from_lvalue(l);
+	const EmuVal* bound = eval_rexpr(loop->bound);
+	if(val->status != STATUS_DEFINED || bound->status != STATUS_DEFINED){
+		delete val;
+		delete bound;
+		return false;
+	}
+	ctr->block = l.ptr.block;
+	ctr->offset = l.ptr.offset;
+	ctr->value = (int32_t)((const EmuNumGeneric*)val)->sext();
+	ctr->bound = (int32_t)((const EmuNumGeneric*)bound)->sext();
+	delete val;
+	delete bound;
+	return true;
+}
+
+bool counted_loop_test(const counted_loop* loop, const loop_counter* ctr){
+	switch(loop->cmp){
+	case BO_LT: return ctr->value < ctr->bound;
+	case BO_LE: return ctr->value <= ctr->bound;
+	case BO_GT: return ctr->value > ctr->bound;
+	case BO_GE: return ctr->value >= ctr->bound;
+	default:    return ctr->value != ctr->bound;
+	}
+}
+
+// the body and debug_dump can see the counter, so it goes back to memory each time
+void counted_loop_step(const counted_loop* loop, loop_counter* ctr){
+	ctr->value = (int32_t)((uint32_t)ctr->value + (uint32_t)loop->step);
+	const EmuNum<NUM_TYPE_INT> next(STATUS_DEFINED, apint_signed_repr(ctr->value));
+	ctr->block->write(&next, ctr->offset);
+}
+
+// Where each value of a switch starts running, worked out the first time the
+// switch runs. Case values close together index a table directly, anything
+// else is binary searched.
+class switch_table{
+public:
+	bool dense;
+	int64_t low;
+	std::vector<unsigned> jumps; // dense: indexed by value-low
+	std::vector<std::pair<int64_t, unsigned> > cases; // sparse: sorted by value
+	unsigned fallback; // the default, or the end of the body
+};
+
+static llvm::DenseMap<const SwitchStmt*, const switch_table*> switch_tables;
+
+static const switch_table* build_switch_table(const SwitchStmt* s){
+	const CompoundStmt* body = (const CompoundStmt*)s->getBody();
+	switch_table* table = new switch_table();
+	table->fallback = body->size();
+
+	unsigned i = 0;
+	for(auto it = body->body_begin(); it != body->body_end(); it++, i++){
+		// case 1: case 2: ... nests the second label inside of the first
+		for(const Stmt* curr = *it; isa<SwitchCase>(curr); curr = ((const SwitchCase*)curr)->getSubStmt()){
+			if(isa<DefaultStmt>(curr)){
+				if(table->fallback == body->size()) table->fallback = i;
+				continue;
+			}
+			const EmuVal* comp = eval_rexpr(((const CaseStmt*)curr)->getLHS());
+			if(!comp->obj_type->isIntegerType()) cant_cast();
+			if(comp->status != STATUS_DEFINED) err_undef();
+			table->cases.push_back(std::make_pair(((const EmuNumGeneric*)comp)->sext(), i));
+			delete comp;
+		}
+	}
+
+	// the first label for a value wins, as in a linear scan
+	std::stable_sort(table->cases.begin(), table->cases.end(), [](const std::pair<int64_t, unsigned>& a, const std::pair<int64_t, unsigned>& b){
+		return a.first < b.first;
+	});
+	auto last = std::unique(table->cases.begin(), table->cases.end(), [](const std::pair<int64_t, unsigned>& a, const std::pair<int64_t, unsigned>& b){
+		return a.first == b.first;
+	});
+	table->cases.erase(last, table->cases.end());
+
+	size_t n = table->cases.size();
+	table->dense = false;
+	if(n > 0){
+		uint64_t span = (uint64_t)table->cases.back().first - (uint64_t)table->cases.front().first;
+		if(span < 2*n + 8){
+			table->dense = true;
+			table->low = table->cases.front().first;
+			table->jumps.assign(span+1, table->fallback);
+			for(auto c : table->cases){
+				table->jumps[(uint64_t)c.first - (uint64_t)table->low] = c.second;
+			}
+			table->cases.clear();
+		}
+	}
+	return table;
+}
+
+unsigned switch_target(const SwitchStmt* s, const EmuVal* value){
+	if(!value->obj_type->isIntegerType()) cant_cast();
+	if(value->status != STATUS_DEFINED) err_undef();
+	int64_t v = ((const EmuNumGeneric*)value)->sext();
+
+	const switch_table* table;
+	const auto found = switch_tables.find(s);
+	if(found == switch_tables.end()){
+		table = build_switch_table(s);
+		switch_tables.insert(std::make_pair(s, table));
+	} else {
+		table = found->second;
+	}
+
+	if(table->dense){
+		uint64_t idx = (uint64_t)v - (uint64_t)table->low;
+		if(idx < table->jumps.size()) return table->jumps[idx];
+		return table->fallback;
+	}
+	auto it = std::lower_bound(table->cases.begin(), table->cases.end(), std::make_pair(v, 0u));
+	if(it != table->cases.end() && it->first == v) return it->second;
+	return table->fallback;
+}
+
 void exec_decl(const Decl* d){
 	if(!isa<VarDecl>(d)){
 		llvm::errs() << "\n\nIgnoring unrecognized declaration:\n";
@@ -576,13 +1414,13 @@ void exec_decl(const Decl* d){
 		val = from_lvalue(lvalue(nullptr,decl->getType(),0));
 	} else {
 		const EmuVal* temp = eval_rexpr(init);
-		val = eval_rexpr(init)->cast_to(decl->getType());
+		val = temp->cast_to(decl->getType());
 		delete temp;
 	}
 
-	mem_block* storage = new mem_block(MEM_TYPE_STACK, val);
-	errs() << "DOUG DEBUG: new variable with name " << decl->getNameAsString() << "\n";
-	add_stack_var(decl->getNameAsString(), lvalue(storage, val->obj_type, 0));
+	mem_block* storage = new_local(val);
+	EMU_LOG(LOG_MEM, LOG_LEVEL_TRACE) << "DOUG DEBUG: new variable with name " << decl->getNameAsString() << "\n";
+	add_stack_var(decl->getNameAsString(), lvalue(storage, val->obj_type, 0), !has_stack_slot(decl));
 }
 
 // null if it just ended with no return call
@@ -591,39 +1429,40 @@ const EmuVal* exec_stmt(const Stmt* s){
 	curr_loc = s->getLocStart();
 	debug_dump();
 
-	errs() << "\n\nDEBUG: about to execute the following statement:\n";
-	s->dump();
-	errs() << "\n\n";
+	if(EMU_LOG_ON(LOG_EVAL, LOG_LEVEL_TRACE)){
+		llvm::errs() << "\n\nDEBUG: about to execute the following statement:\n";
+		s->dump();
+		llvm::errs() << "\n\n";
+	}
 
 	const EmuVal* retval = nullptr;
 	if(isa<CompoundStmt>(s)){
 		const CompoundStmt* stmt = (const CompoundStmt*)s;
-		add_stack_frame();
+		bool framed = enter_scope(s);
 		for(auto it = stmt->body_begin(); it != stmt->body_end(); it++){
 			retval = exec_stmt((const Stmt*)*it);
 			if(retval != nullptr){
 				break;
 			}
 		}
-		llvm::errs() << "DOUG DEBUG: popping frame leaving compoundstmt\n";
-		pop_stack_frame();
+		if(framed){
+			EMU_LOG(LOG_MEM, LOG_LEVEL_TRACE) << "DOUG DEBUG: popping frame leaving compoundstmt\n";
+			pop_stack_frame();
+		}
 	} else if(isa<DeclStmt>(s)){
 		const DeclStmt* stmt = (const DeclStmt*)s;
 		for(auto it = stmt->decl_begin(); it != stmt->decl_end(); it++){
 			exec_decl(*it);
 		}
 	} else if(isa<Expr>(s)){
-		llvm::errs() << "DOUG DEBUG: the following is an expr:\n";
-		s->dump();
-		eval_rexpr((const Expr*)s);
+		EMU_LOG(LOG_EVAL, LOG_LEVEL_TRACE) << "DOUG DEBUG: the following is an expr\n";
+		eval_discard((const Expr*)s);
 	} else if(isa<ReturnStmt>(s)){
 		const ReturnStmt* stmt = (const ReturnStmt*)s;
 		return eval_rexpr(stmt->getRetValue());
 	} else if(isa<IfStmt>(s)){
 		const IfStmt* stmt = (const IfStmt*)s;
-		const Expr* cond = stmt->getCond();
-		const EmuVal* eval = eval_rexpr(cond);
-		if(is_scalar_zero(eval)){
+		if(expr_is_zero(stmt->getCond())){
 			const Stmt* next = stmt->getElse();
 			if(next == nullptr) return nullptr;
 			return exec_stmt(stmt->getElse());
@@ -632,58 +1471,48 @@ const EmuVal* exec_stmt(const Stmt* s){
 		}
 	} else if(isa<ForStmt>(s)){
 		const ForStmt* stmt = (const ForStmt*)s;
-		add_stack_frame();
+		bool framed = enter_scope(s);
 		const Stmt* init = stmt->getInit();
 		const Expr* cond = stmt->getCond();
 		const Expr* inc = stmt->getInc();
 		const Stmt* body = stmt->getBody();
 		retval = exec_stmt(init);
-		if(retval == nullptr){
+		const counted_loop* counted = find_counted_loop(stmt);
+		loop_counter ctr;
+		if(retval == nullptr && counted != nullptr && start_counted_loop(counted, &ctr)){
+			while(counted_loop_test(counted, &ctr)){
+				retval = exec_stmt(body);
+				if(retval != nullptr){
+					break;
+				}
+				counted_loop_step(counted, &ctr);
+			}
+		} else if(retval == nullptr){
 			while(1){
-				const EmuVal* temp = eval_rexpr(cond);
-				bool z = is_scalar_zero(temp);
-				delete temp;
-				if(z) break;
+				if(expr_is_zero(cond)) break;
 
 				retval = exec_stmt(body);
 				if(retval != nullptr){
 					break;
 				}
-				eval_rexpr(inc);
+				eval_discard(inc);
 			}
 		}
-		llvm::errs() << "DOUG DEBUG: popping frame leaving for loop\n";
-		pop_stack_frame();
+		if(framed){
+			EMU_LOG(LOG_MEM, LOG_LEVEL_TRACE) << "DOUG DEBUG: popping frame leaving for loop\n";
+			pop_stack_frame();
+		}
 	} else if(isa<NullStmt>(s)){
 		// do nothing, naturally
 	} else if(isa<SwitchStmt>(s)){
-		add_stack_frame();
+		bool framed = enter_scope(s);
 		const SwitchStmt* stmt = (const SwitchStmt*)s;
 		const EmuVal* value = eval_rexpr(stmt->getCond());
-		if(!value->obj_type->isIntegerType()) cant_cast();
-		const EmuNumGeneric* val = (const EmuNumGeneric*)value;
 		const Stmt* code = (const Stmt*)stmt->getBody();
 		if(!isa<CompoundStmt>(code)) cant_handle();
 		const CompoundStmt* sub = (const CompoundStmt*)code;
-		auto it = sub->body_begin();
-		for(; it != sub->body_end(); it++){
-			const Stmt* curr = *it;
-			if(isa<CaseStmt>(curr)){
-				const CaseStmt* c = (const CaseStmt*)curr;
-				const EmuVal* comp = eval_rexpr(c->getLHS());
-				if(!comp->obj_type->isIntegerType()) cant_cast();
-				const EmuNumGeneric* cmp = (const EmuNumGeneric*)comp;
-				if(val->equals(cmp)){
-					break;
-				}
-			}
-		}
-		if(it == sub->body_end()){
-			// find the default statement
-			for(it = sub->body_begin(); it != sub->body_end(); it++){
-				if(isa<DefaultStmt>(*it)) break;
-			}
-		}
+		auto it = sub->body_begin() + switch_target(stmt, value);
+		delete value;
 		for(; it != sub->body_end(); it++){
 			const EmuVal* returned = exec_stmt(*it);
 			if(returned != nullptr){
@@ -691,10 +1520,12 @@ const EmuVal* exec_stmt(const Stmt* s){
 				break;
 			}
 		}
-		llvm::errs() << "DOUG DEBUG: popping frame leaving switch\n";
-		pop_stack_frame();
+		if(framed){
+			EMU_LOG(LOG_MEM, LOG_LEVEL_TRACE) << "DOUG DEBUG: popping frame leaving switch\n";
+			pop_stack_frame();
+		}
 	} else if(isa<SwitchCase>(s)){
-		llvm::errs() << "DOUG DEBUG: detected switchcase\n";
+		EMU_LOG(LOG_EVAL, LOG_LEVEL_TRACE) << "DOUG DEBUG: detected switchcase\n";
 		return exec_stmt(((const SwitchCase*)s)->getSubStmt());
 	} else if(isa<BreakStmt>(s)){
 		return BREAK_POINTER;
@@ -740,7 +1571,7 @@ static void SetupVar(const ValueDecl *obj, int source) {
 
 		if(l.ptr.block != nullptr){
 			// if it is defined, find the definition and unhide it
-			EmuFunc f(l.ptr.block->data, obj->getType());
+			EmuFunc f(l.ptr.block->at(0), l.ptr.block->size, obj->getType());
 
 			if(f.status == STATUS_DEFINED){
 				auto it2 = global_functions.find(f.func_id);
@@ -784,19 +1615,23 @@ static void InitializeVar(const VarDecl *v, int source) {
 	curr_loc = v->getLocation();
 	debug_dump();
 
-	llvm::errs() << "DOUG DEBUG: about to resolve right hand of initialization:\n";
-	init->dump();
+	if(EMU_LOG_ON(LOG_EVAL, LOG_LEVEL_INFO)){
+		llvm::errs() << "DOUG DEBUG: about to resolve right hand of initialization:\n";
+		init->dump();
+	}
 	const EmuVal* temp = eval_rexpr(init);
-	llvm::errs() << "DOUG DEBUG: about to cast obtained object ("<<((const void*)temp)<<") to the following decl:\n";
-	v->dump();
+	if(EMU_LOG_ON(LOG_EVAL, LOG_LEVEL_INFO)){
+		llvm::errs() << "DOUG DEBUG: about to cast obtained object ("<<((const void*)temp)<<") to the following decl:\n";
+		v->dump();
+	}
 	const EmuVal* val = temp->cast_to(v->getType());
 	delete temp;
 
 	std::string name = v->getNameAsString();
 	lvalue loc = local_vars[source].find(name)->second;
-	val->dump_repr(&((char*)loc.ptr.block->data)[loc.ptr.offset]);
+	loc.ptr.block->write(val, loc.ptr.offset);
 	
-	llvm::errs() << "DOUG DEBUG: variable "<<name<<" stored at block id "<<loc.ptr.block->id<<"\n";
+	EMU_LOG(LOG_MEM, LOG_LEVEL_INFO) << "DOUG DEBUG: variable "<<name<<" stored at block id "<<loc.ptr.block->id<<"\n";
 
 	delete val;
 	return;
@@ -838,9 +1673,9 @@ void RunProgram(void){
 		if(ms == -1){
 			err_exit("No main method declared");
 		}
-		printf("DOUG DEBUG: ms=%d\n",ms);
+		EMU_LOG(LOG_CALL, LOG_LEVEL_INFO) << "DOUG DEBUG: ms="<<ms<<"\n";
 		auto it = local_vars[ms].find("main");
-		EmuFunc f(it->second.ptr.block->data, it->second.type);
+		EmuFunc f(it->second.ptr.block->at(0), it->second.ptr.block->size, it->second.type);
 		auto it2 = global_functions.find(f.func_id);
 		if(it2 == global_functions.end()){
 			err_exit("No main method defined\n");
@@ -857,7 +1692,9 @@ void RunProgram(void){
 		err_exit("Return type for main must be an int");
 	}
 
+	frame_base = stack_vars.size();
 	add_stack_frame();
+	resolve_function(func);
 
 	auto it = func->param_begin();
 	if(it != func->param_end()){
@@ -889,7 +1726,13 @@ void RunProgram(void){
 	}
 
 	const Stmt* mainbody = func->getBody();
-	const EmuVal* retval = exec_stmt(mainbody);
+	const EmuVal* retval;
+	if(UseBytecode){
+		compile_functions();
+		retval = run_function(func);
+	} else {
+		retval = exec_stmt(mainbody);
+	}
 	if(retval != nullptr){
 		curr_loc = mainbody->getLocEnd();
 		debug_dump();
@@ -899,6 +1742,6 @@ void RunProgram(void){
 }
 
 void do_exit(const EmuNum<NUM_TYPE_INT>* retval){
-	errs() << "\n\nDEBUG: Exit value: " << retval->val.toString(10, true) << "\n";
+	errs() << "\n\nDEBUG: Exit value: " << retval->sext() << "\n";
 	exit_clean();
 }
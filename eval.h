@@ -1,6 +1,8 @@
 #include <vector>
 
 #include "clang/AST/Expr.h"
+#include "clang/AST/Stmt.h"
+#include "llvm/ADT/DenseMap.h"
 
 #include "enums.h"
 #include "types.h"
@@ -12,7 +14,65 @@ extern int curr_source;
 
 void do_exit(const EmuNum<NUM_TYPE_INT>*);
 const EmuVal* eval_rexpr(const Expr*);
+// eval_rexpr for an integer expression, without making an EmuVal
+emu_num eval_num(const Expr*);
+// whether a condition is zero, as is_scalar_zero on its value
+bool expr_is_zero(const Expr*);
+// evaluates an expression for its side effects
+void eval_discard(const Expr*);
 const EmuVal* exec_stmt(const Stmt*);
+void exec_decl(const Decl*);
+
+// what a call to an internal function has to put back when it returns
+class saved_call{
+public:
+	int source;
+	size_t base;
+};
+
+// Evaluates the callee and arguments of a call and pushes their frame. For an
+// external function the result is left in the second argument and null is
+// returned; otherwise the definition to run is returned, and leave_call must be
+// made once its body has finished.
+const FunctionDecl* enter_call(const CallExpr*, const EmuVal**, saved_call*);
+void leave_call(const saved_call*);
+
+// Whether a compound, for or switch statement declares anything and so needs a
+// frame of its own, with the bytes to set aside for its locals when it does.
+bool scope_frame(const Stmt*, size_t*);
+
+// the parts of a canonical counted for loop, see find_counted_loop
+class counted_loop{
+public:
+	const Expr* var; // the induction variable
+	BinaryOperatorKind cmp;
+	const Expr* bound;
+	int32_t step;
+};
+
+// a running counted loop
+class loop_counter{
+public:
+	mem_block* block;
+	size_t offset;
+	int32_t value;
+	int32_t bound;
+};
+
+const counted_loop* find_counted_loop(const ForStmt*);
+// false if the counter or bound is undefined, in which case the loop has to
+// run the ordinary way
+bool start_counted_loop(const counted_loop*, loop_counter*);
+bool counted_loop_test(const counted_loop*, const loop_counter*);
+void counted_loop_step(const counted_loop*, loop_counter*);
+
+// index into the body of a switch (a CompoundStmt) of the statement to start
+// from for the given value, or the size of the body if nothing matches
+unsigned switch_target(const SwitchStmt*, const EmuVal*);
+
+// calls the bytecode VM has already made, handed back by eval_rexpr when it
+// reaches the same CallExpr instead of calling again
+extern llvm::DenseMap<const CallExpr*, const EmuVal*>* call_results;
 
 void RunProgram(void);
 void StoreFuncImpls(int);
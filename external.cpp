@@ -34,7 +34,7 @@ const EmuVal* call_external(uint32_t id){
 }
 
 const EmuVal* emu_malloc(void){
-	const auto vars = stack_vars.back();
+	const auto& vars = stack_vars.back();
 	if(vars.size() < 1){
 		err_exit("Malloc requires an argument");
 	}
@@ -47,14 +47,14 @@ const EmuVal* emu_malloc(void){
 	if(!def){
 		err_undef();
 	}
-	uint64_t num_bytes = arg->val.getLimitedValue();
+	uint64_t num_bytes = arg->zext();
 	mem_block *newblock = new mem_block(MEM_TYPE_HEAP, num_bytes);
 	delete arg;
 	return new EmuPtr(mem_ptr(newblock, 0), VoidPtrType);
 }
 
 const EmuVal* emu_free(void){
-	const auto vars = stack_vars.back();
+	const auto& vars = stack_vars.back();
 	if(vars.size() < 1){
 		err_exit("Free requires an argument");
 	}
@@ -69,25 +69,31 @@ const EmuVal* emu_free(void){
 	}
 	mem_block* block = arg->u.block;
 	delete arg;
-	delete block;
+	if(block == nullptr){
+		return new EmuVoid(); // free(NULL) does nothing
+	}
+	if(block->memtype != MEM_TYPE_HEAP){
+		err_exit("Tried to free memory that wasn't allocated by malloc");
+	}
+	block->free(DEATH_FREED);
 	return new EmuVoid();
 }
 
 // lvalue-based here, remember not to call from_lvalue on arguments
 const EmuVal* emu_va_start(void){
-	const auto vars = stack_vars.back();
+	const auto& vars = stack_vars.back();
 	if(vars.size() < 2){
 		err_exit("va_start requires 2 arguments");
 	}
 	const lvalue _to = vars[0].second;
 	const lvalue _from = vars[1].second;
-	const EmuStackPos* to = new EmuStackPos(&((char*)_to.ptr.block->data)[_to.ptr.offset]);
-	const EmuStackPos* from = new EmuStackPos(&((char*)_from.ptr.block->data)[_from.ptr.offset]);
+	const EmuStackPos* to = new EmuStackPos(_to.ptr.block->at(_to.ptr.offset), _to.ptr.block->size-_to.ptr.offset);
+	const EmuStackPos* from = new EmuStackPos(_from.ptr.block->at(_from.ptr.offset), _from.ptr.block->size-_from.ptr.offset);
 	lvalue tostorage = stack_vars[to->level][to->num].second;
 	if(tostorage.ptr.block->size < tostorage.ptr.offset + EMU_SIZE_STACKPOS){
 		err_exit("Not enough size for va_list storage");
 	}
-	from->dump_repr(&((char*)tostorage.ptr.block->data)[tostorage.ptr.offset]);
+	tostorage.ptr.block->write(from, tostorage.ptr.offset);
 
 	return new EmuVoid();
 }
\ No newline at end of file
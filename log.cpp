@@ -0,0 +1,30 @@
+#include "llvm/Support/CommandLine.h"
+#include "help.h"
+#include "log.h"
+
+unsigned log_mask = 0;
+unsigned log_level = LOG_LEVEL_INFO;
+
+static llvm::cl::list<std::string> LogCategories("log", llvm::cl::desc("Print debug logging for a comma separated list of eval, mem, call, types or all"), llvm::cl::CommaSeparated, llvm::cl::cat(MyHelp));
+static llvm::cl::opt<unsigned, true> LogLevel("log-level", llvm::cl::desc("Detail of debug logging (1 = info, 2 = trace)"), llvm::cl::location(log_level), llvm::cl::cat(MyHelp));
+
+static const char* const log_names[] = {"eval", "mem", "call", "types"};
+
+bool init_logging(void){
+	for(const std::string& name : LogCategories){
+		if(name.compare("all") == 0){
+			log_mask = ~0u;
+			continue;
+		}
+		unsigned i;
+		for(i = 0; i < sizeof(log_names)/sizeof(log_names[0]); i++){
+			if(name.compare(log_names[i]) == 0) break;
+		}
+		if(i == sizeof(log_names)/sizeof(log_names[0])){
+			llvm::errs() << "Unknown log category: "<<name<<"\n";
+			return false;
+		}
+		log_mask |= 1u << i;
+	}
+	return true;
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include "llvm/Support/raw_ostream.h"
+
+// Debug logging. Each message has a category and a level; it is printed only
+// if its category was turned on with -log and its level is at most
+// -log-level. Building with -DEMU_NO_LOG removes all of it.
+//
+//	EMU_LOG(LOG_MEM, LOG_LEVEL_INFO) << "message " << n << "\n";
+//	if(EMU_LOG_ON(LOG_EVAL, LOG_LEVEL_TRACE)) e->dump();
+//
+// The stream operands are only evaluated when the message will be printed.
+
+enum log_cat_t {
+	LOG_EVAL,  // statements and expressions being executed
+	LOG_MEM,   // stack frames, variables and blocks
+	LOG_CALL,  // function calls
+	LOG_TYPES, // decoding values out of memory
+};
+
+enum log_level_t {
+	LOG_LEVEL_INFO = 1,
+	LOG_LEVEL_TRACE = 2,
+};
+
+extern unsigned log_mask;  // bit (1<<cat) set for each enabled category
+extern unsigned log_level;
+
+#ifdef EMU_NO_LOG
+#define EMU_LOG_ON(cat, lvl) false
+#else
+#define EMU_LOG_ON(cat, lvl) __builtin_expect((log_mask & (1u << (cat))) != 0 && (unsigned)(lvl) <= log_level, 0)
+#endif
+
+#define EMU_LOG(cat, lvl) if(!EMU_LOG_ON(cat, lvl)){} else llvm::errs()
+
+// reads -log into log_mask, false if it names an unknown category
+bool init_logging(void);
@@ -4,6 +4,7 @@
 
 #include "eval.h"
 #include "help.h"
+#include "log.h"
 #include "main.h"
 
 using namespace clang;
@@ -13,6 +14,9 @@ int num_sources;
 
 bool static_init = false;
 
+static llvm::cl::opt<std::string> ASTDir(llvm::cl::Positional, llvm::cl::desc("<ast directory>"), llvm::cl::Required, llvm::cl::cat(MyHelp));
+static llvm::cl::opt<std::string> SourceFile(llvm::cl::Positional, llvm::cl::desc("<source file>"), llvm::cl::Required, llvm::cl::cat(MyHelp));
+
 class ErrorCatcher : public DiagnosticConsumer {
 public:
 	ErrorCatcher() {};
@@ -41,24 +45,24 @@ int main(int argc, const char ** argv) {
 //	tooling::CommonOptionsParser argParser(argc, argv, MyHelp);
 //	tooling::ClangTool tool(argParser.getCompilations(), argParser.getSourcePathList());
 
+	llvm::cl::ParseCommandLineOptions(argc, argv);
+	if(!init_logging()){
+		return 1;
+	}
+
 	IntrusiveRefCntPtr<DiagnosticIDs> diag_ids(new DiagnosticIDs());
 	IntrusiveRefCntPtr<DiagnosticsEngine> engine(new DiagnosticsEngine(diag_ids, new DiagnosticOptions(), (DiagnosticConsumer*)new ErrorCatcher()));
 
 	FileSystemOptions fsopts;
 
-	if(argc < 3){
-		llvm::errs() << "Missing arg\n";
-		return 1;
-	}
-
 	std::vector<std::unique_ptr<ASTUnit> > ast_list;
 
-	DIR* dir = opendir(argv[1]);
+	DIR* dir = opendir(ASTDir.c_str());
 	if(dir == NULL){
-		llvm::errs() << "Bad AST directory: "<<argv[1]<<"\n";
+		llvm::errs() << "Bad AST directory: "<<ASTDir<<"\n";
 		return 1;
 	}
-	fsopts.WorkingDir += argv[1];
+	fsopts.WorkingDir += ASTDir;
 	while(struct dirent *entry = readdir(dir)){
 		const char* name = entry->d_name;
 		if(strstr(name, ".ast") == NULL) continue;
@@ -71,7 +75,7 @@ int main(int argc, const char ** argv) {
 
 	const char** args = new const char*[2];
 	args[0] = "-undef";
-	args[1] = argv[2];
+	args[1] = SourceFile.c_str();
 	ASTUnit* file = ASTUnit::LoadFromCommandLine(&args[0], &args[2], engine, ".");
 
 	ast_list.push_back(std::unique_ptr<ASTUnit>(file));
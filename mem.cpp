@@ -1,13 +1,32 @@
+#include <algorithm>
+#include <new>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 #include "exit.h"
+#include "help.h"
+#include "log.h"
+#include "main.h"
 #include "mem.h"
-#include "rbtree.h"
 #include "types.h"
 
+bool recycle_block_ids = false;
+static llvm::cl::opt<bool, true> RecycleBlockIds("recycle-block-ids", llvm::cl::desc("Reuse the ids of dead blocks once 2^24 have been handed out, so long running programs can keep allocating"), llvm::cl::location(recycle_block_ids), llvm::cl::cat(MyHelp));
+
+bool lazy_tags = false;
+static llvm::cl::opt<bool, true> LazyTags("lazy-tags", llvm::cl::desc("Put off updating memory tags until they are looked at"), llvm::cl::location(lazy_tags), llvm::cl::cat(MyHelp));
+
+static llvm::cl::opt<unsigned> HeapQuarantine("heap-quarantine", llvm::cl::desc("Bytes of freed heap memory to hold back, poisoned, before it is reused"), llvm::cl::init(1 << 20), llvm::cl::cat(MyHelp));
+
 static block_id_t id_counter = BLOCK_ID_START;
 
 static block_id_t new_block_id(void){
 	block_id_t ans = id_counter;
+	if(recycle_block_ids && ans > block_table::SLOT_MASK){ // no fresh slots left
+		return active_mem.reuse_id();
+	}
 	if(ans == 0){ // has wrapped around
 		err_exit("Too many allocations");
 	}
@@ -25,18 +44,20 @@ uint32_t new_fid(void){
 	return ans;
 }
 
-std::unordered_map<block_id_t, mem_block*> active_mem;
+block_table active_mem;
 std::unordered_map<std::string, std::deque<std::pair<int,int> > > stack_var_map;
 std::vector<std::vector<std::pair<std::string, lvalue> > > stack_vars;
 std::unordered_map<std::string, lvalue>* local_vars;
 std::unordered_map<std::string, int> global_vars;
 std::unordered_map<uint32_t, std::pair<int, const void*> > global_functions;
+size_t frame_base = 0; // index in stack_vars of the frame holding the current function's arguments
 
-void add_stack_var(std::string name, lvalue loc){
+void add_stack_var(std::string name, lvalue loc, bool by_name){
 	int n = stack_vars.size()-1;
 	int i = stack_vars[n].size();
-	llvm::errs() << "DOUG MEM DEBUG: adding "<<name<<" at stack location "<<n<<","<<i<<" with block at "<<((void*)loc.ptr.block)<<"\n";
+	EMU_LOG(LOG_MEM, LOG_LEVEL_INFO) << "DOUG MEM DEBUG: adding "<<name<<" at stack location "<<n<<","<<i<<" with block at "<<((void*)loc.ptr.block)<<"\n";
 	stack_vars.back().push_back(std::pair<std::string, lvalue> (name, loc));
+	if(!by_name) return;
 	auto list = stack_var_map.find(name);
 	if(list == stack_var_map.end()){
 		std::deque<std::pair<int, int> > newq = std::deque<std::pair<int, int> >();
@@ -47,33 +68,95 @@ void add_stack_var(std::string name, lvalue loc){
 	}
 }
 
-void add_stack_frame(void){
+// The space set aside for the locals of each frame in stack_vars, so a scope
+// makes one allocation however many variables it has. Each local's mem_block
+// is placed in it, followed by the local's data and tag plane. A block still
+// pinned when its frame is popped keeps the space until it goes too.
+class frame_space{
+public:
+	size_t size; // of the space after this header
+	size_t used;
+	unsigned blocks; // placed in it and not destroyed yet
+	bool popped;
+
+	char* at(size_t offset){
+		return (char*)(this+1)+offset;
+	}
+};
+static std::vector<frame_space*> frame_spaces; // null for frames without space
+
+size_t local_space(size_t s){
+	const size_t align = alignof(mem_block);
+	return (sizeof(mem_block)+s+tag_plane_size(s)+align-1)/align*align;
+}
+
+void add_stack_frame(size_t bytes){
 	stack_vars.push_back(std::vector<std::pair<std::string, lvalue>>());
-	llvm::errs() << "DOUG MEM DEBUG: adding stack frame, there are now "<<stack_vars.size()<<"\n";
+	frame_space* f = nullptr;
+	if(bytes != 0){
+		f = (frame_space*)new char[sizeof(frame_space)+bytes];
+		f->size = bytes;
+		f->used = 0;
+		f->blocks = 0;
+		f->popped = false;
+	}
+	frame_spaces.push_back(f);
+	EMU_LOG(LOG_MEM, LOG_LEVEL_TRACE) << "DOUG MEM DEBUG: adding stack frame of "<<bytes<<" bytes, there are now "<<stack_vars.size()<<"\n";
 }
 
 void pop_stack_frame(void){
-	auto frame = stack_vars.back();
-	stack_vars.pop_back();
-	for(auto it = frame.cbegin(); it != frame.cend(); it++){
-		std::string name = it->first;
-		auto list = &stack_var_map.find(name)->second;
-//		llvm::errs() << "DOUG MEM DEBUG: while popping stack frame, deleting local var "<<name<<" from list of "<<list->size()<<" with that name\n";
-//		llvm::errs() << "DOUG MEM DEBUG: most recent list element has loc "<<list->back().first<<","<<list->back().second<<"\n";
-//		llvm::errs() << "DOUG MEM DEBUG: oldest list element has loc "<<list->front().first<<","<<list->front().second<<"\n";
-		bool erase = (list->size() == 1);
-		list->pop_back();
-		if(erase){
-			stack_var_map.erase(name);
+	const auto& frame = stack_vars.back();
+	int n = stack_vars.size()-1;
+	int i = 0;
+	for(auto it = frame.cbegin(); it != frame.cend(); it++, i++){
+		// only variables added by_name are in stack_var_map, most aren't
+		if(!stack_var_map.empty()){
+			const std::string& name = it->first;
+			auto found = stack_var_map.find(name);
+			if(found != stack_var_map.end() && found->second.back() == std::pair<int, int>(n, i)){
+				auto list = &found->second;
+//				llvm::errs() << "DOUG MEM DEBUG: while popping stack frame, deleting local var "<<name<<" from list of "<<list->size()<<" with that name\n";
+//				llvm::errs() << "DOUG MEM DEBUG: most recent list element has loc "<<list->back().first<<","<<list->back().second<<"\n";
+//				llvm::errs() << "DOUG MEM DEBUG: oldest list element has loc "<<list->front().first<<","<<list->front().second<<"\n";
+				list->pop_back();
+				if(list->empty()){
+					stack_var_map.erase(found);
+				}
+			}
 		}
-		it->second.ptr.block->free();
+		it->second.ptr.block->free(DEATH_OUT_OF_SCOPE);
+	}
+	stack_vars.pop_back();
+	frame_space* f = frame_spaces.back();
+	frame_spaces.pop_back();
+	if(f != nullptr){
+		f->popped = true;
+		if(f->blocks == 0) delete[] (char*)f;
 	}
-	llvm::errs() << "DOUG MEM DEBUG: popping stack frame, there are now "<<stack_vars.size()<<"\n";
+	EMU_LOG(LOG_MEM, LOG_LEVEL_TRACE) << "DOUG MEM DEBUG: popping stack frame, there are now "<<stack_vars.size()<<"\n";
 }
 
-// only next isn't set immediately
-mem_tag::mem_tag(size_t o, size_t s, rbnode<mem_tag>* p, QualType t)
-	: offset(o),type(t),prev(p)
+mem_block* new_local(const EmuVal* val){
+	size_t n = local_space(val->size());
+	frame_space* f = frame_spaces.empty() ? nullptr : frame_spaces.back();
+	if(f != nullptr && f->size - f->used >= n){
+		char* storage = f->at(f->used);
+		f->used += n;
+		f->blocks++;
+		return new (storage) mem_block(MEM_TYPE_STACK, val, f);
+	}
+	// more than the layout planned for, e.g. a variable length array
+	return new mem_block(MEM_TYPE_STACK, val);
+}
+
+mem_tag::mem_tag(void)
+	: offset(0),type(RawType),typesize(1),count(0)
+{
+}
+
+// a value of size s, or s bytes of raw
+mem_tag::mem_tag(size_t o, size_t s, QualType t)
+	: offset(o),type(t)
 {
 	if(t == RawType){
 		typesize = 1;
@@ -84,151 +167,188 @@ mem_tag::mem_tag(size_t o, size_t s, rbnode<mem_tag>* p, QualType t)
 	}
 }
 
-size_t mem_tag::sortval(void) const{
-	return offset;
+mem_tag::mem_tag(size_t o, size_t s, size_t c, QualType t)
+	: offset(o),type(t),typesize(s),count(c)
+{
 }
 
-void mem_block::deal_with_end(rbnode<mem_tag>* extended, rbnode<mem_tag>* affected, size_t endpos){
-	for(;affected != nullptr; affected = affected->value.next){
-		size_t offset = affected->value.offset;
+// Vectors of tags given up by blocks, kept with their storage for the next
+// block that needs one, so blocks gaining and losing tags don't go through the
+// host allocator each time. Very large ones aren't worth holding on to.
+static std::vector<std::vector<mem_tag>*> spare_tag_vectors;
+static const size_t MAX_SPARE_TAG_VECTORS = 256;
+static const size_t MAX_SPARE_TAG_CAPACITY = 1024;
 
-		if (offset >= endpos){
-			if(offset == endpos && extended->value.type == affected->value.type){
-				// merge
-				extended->value.count += affected->value.count;
-			} else {
-				affected->value.prev = extended;
-				break;
-			}
-		} else {
-			size_t typesize = affected->value.typesize;
-			size_t count = affected->value.count;
-			size_t end = offset+typesize*count;
-			if(end > endpos){
-				// we cut it, now we must repair
-				size_t firstvalid = (endpos-offset+typesize-1)/typesize;
-				if(firstvalid == 0){ // check overflow case
-					firstvalid = SIZE_MAX/typesize;
-				}
+static std::vector<mem_tag>* take_tag_vector(void){
+	if(spare_tag_vectors.empty()){
+		return new std::vector<mem_tag>();
+	}
+	std::vector<mem_tag>* ans = spare_tag_vectors.back();
+	spare_tag_vectors.pop_back();
+	return ans;
+}
 
-				size_t invalidbytes = firstvalid*typesize;
-				size_t alignbytes = offset+invalidbytes-endpos;
-				affected->value.offset = endpos;
-				if(alignbytes == 0){
-					affected->value.count = count-firstvalid; // must be nonzero
-				} else {
-					size_t newcount = count-firstvalid;
-					if(newcount == 0){
-						//convert to raw
-						affected->value.type = RawType;
-						affected->value.typesize = 1;
-						affected->value.count = newcount*typesize;
-					} else {
-						//need to insert raw, move back this
-						rbnode<mem_tag>* newtag = tags.insert(mem_tag(offset+invalidbytes,newcount,affected,RawType));
-						affected->value.type = RawType;
-						affected->value.prev = extended;
-						affected->value.next = newtag;
-						affected->value.typesize = 1;
-						affected->value.count = alignbytes;
-					}
-				}
-				break;
-			}
-		}
-		tags.remove(affected);
-		delete affected;
+static void give_tag_vector(std::vector<mem_tag>* v){
+	if(v == nullptr) return;
+	if(spare_tag_vectors.size() >= MAX_SPARE_TAG_VECTORS || v->capacity() > MAX_SPARE_TAG_CAPACITY){
+		delete v;
+		return;
 	}
-	extended->value.next = affected;
+	v->clear();
+	spare_tag_vectors.push_back(v);
+}
+
+tag_map::tag_map(void)
+	: many(nullptr),has_one(false),has_pending(false)
+{
+}
+
+tag_map::~tag_map(void){
+	give_tag_vector(many);
 }
 
-// called on each memory write so we can update memory tags
-void mem_block::update_tag_write(const EmuVal* obj, size_t offset){
-	QualType qtype = obj->obj_type;
-	rbnode<mem_tag>* start = tags.findBelow(offset);
-	rbnode<mem_tag>* newtag;
+void tag_map::clear(void){
+	give_tag_vector(many);
+	many = nullptr;
+	has_one = false;
+	has_pending = false;
+}
 
-	if(start == nullptr){
-		size_t typesize = obj->size();
-		newtag = tags.insert(mem_tag(offset, typesize, nullptr, qtype));
-		deal_with_end(newtag, firsttag, offset+typesize);
-		firsttag = newtag;
+// adds a tag after the others in out, merging it into the last if it carries on
+// the same list
+static void push_tag(mem_tag* out, size_t* n, const mem_tag& t){
+	if(*n > 0){
+		mem_tag& last = out[*n-1];
+		if(last.type == t.type && last.typesize == t.typesize && last.end() == t.offset){
+			last.count += t.count;
+			return;
+		}
+	}
+	out[(*n)++] = t;
+}
+
+void tag_map::write(size_t offset, size_t size, QualType type){
+	if(size == 0) return;
+	mem_tag w(offset, size, type);
+	if(!lazy_tags){
+		apply(w);
 		return;
 	}
-	size_t start_typesize = start->value.typesize;
-	size_t start_offset = start->value.offset;
-	size_t start_endpos = start_offset + start->value.count*start_typesize;
-	// check if we are right after the previous tag
-	if(offset == start_endpos){
-		// check for combining with that
-		QualType start_type = start->value.type;
-		if(qtype == start_type){
-			size_t newcount = start->value.count+1;
-			start->value.count = newcount;
-			deal_with_end(start, start->value.next, start_endpos+start_typesize);
-			return;
+	if(has_pending){
+		if(w.type == pending.type && w.typesize == pending.typesize){
+			if(w.offset == pending.end()){
+				pending.count += w.count;
+				return;
+			}
+			if(pending.offset <= w.offset && w.end() <= pending.end()
+					&& (w.offset-pending.offset)%w.typesize == 0){
+				return;
+			}
 		}
+		settle();
 	}
-	// if we start in an uninit range, just stick the new one in
-	if(offset >= start_endpos){
-		size_t typesize = obj->size();
-		newtag = tags.insert(mem_tag(offset, typesize, start, qtype));
-		deal_with_end(newtag, start->value.next, offset+typesize);
-		start->value.next = newtag;
+	pending = w;
+	has_pending = true;
+}
+
+void tag_map::settle(void) const{
+	has_pending = false;
+	apply(pending);
+}
+
+void tag_map::apply(const mem_tag& w) const{
+	size_t offset = w.offset;
+	size_t endpos = w.end();
+	const mem_tag* first = many != nullptr ? many->data() : &one;
+	const mem_tag* last = many != nullptr ? many->data()+many->size() : &one+(has_one ? 1 : 0);
+
+	// the tags touching the write, including ones that end right before it
+	// or start right after it, which it might merge with
+	const mem_tag* lo = std::partition_point(first, last, [offset](const mem_tag& t){
+		return t.end() < offset;
+	});
+	const mem_tag* hi = std::partition_point(lo, last, [endpos](const mem_tag& t){
+		return t.offset <= endpos;
+	});
+
+	// rewriting one of a list's objects with the same type changes nothing
+	if(lo != hi && lo->type == w.type && lo->typesize == w.typesize && lo->offset <= offset
+			&& endpos <= lo->end() && (offset-lo->offset)%w.typesize == 0){
 		return;
 	}
-	// else, this tag cuts off part or all of start
 
-	// if we are aligned, we can avoid creating a tag for raw data from fragmentation
-	size_t start_lastvalid = (offset-start_offset)/start_typesize;
-	size_t start_validbytes = start_lastvalid*start_typesize;
-	size_t alignbytes = offset-(start_offset+start_validbytes);
-	if(alignbytes == 0){
-		// check if the tag is already correct
-		QualType start_type = start->value.type;
-		if(qtype == start_type) return;
+	mem_tag out[5];
+	size_t n = 0;
+	if(lo != hi && lo->offset < offset){
+		// keep the whole objects before the write, the rest of a split one is raw
+		size_t whole = (offset-lo->offset)/lo->typesize;
+		if(whole > 0){
+			push_tag(out, &n, mem_tag(lo->offset, lo->typesize, whole, lo->type));
+		}
+		size_t rawstart = lo->offset+whole*lo->typesize;
+		if(rawstart < offset){
+			push_tag(out, &n, mem_tag(rawstart, offset-rawstart, RawType));
+		}
 	}
-	size_t typesize = obj->size();
-	if(start_offset == offset){
-		// check if we overwrite start entirely
-		if(start_endpos <= offset+typesize){
-			start->value.type = qtype;
-			start->value.typesize = typesize;
-			start->value.count = 1;
-			deal_with_end(start, start->value.next, offset+typesize);
-			return;
+	push_tag(out, &n, w);
+	if(lo != hi){
+		const mem_tag* r = hi-1;
+		if(r->end() > endpos){
+			if(r->offset >= endpos){
+				push_tag(out, &n, *r);
+			} else {
+				// the first whole object after the write, before it is raw
+				size_t firstvalid = (endpos-r->offset+r->typesize-1)/r->typesize;
+				size_t validstart = r->offset+firstvalid*r->typesize;
+				if(validstart > endpos){
+					push_tag(out, &n, mem_tag(endpos, std::min(validstart, r->end())-endpos, RawType));
+				}
+				if(firstvalid < r->count){
+					push_tag(out, &n, mem_tag(validstart, r->typesize, r->count-firstvalid, r->type));
+				}
+			}
 		}
-		// else we just need to insert a "new" tag for what's left
-		newtag = tags.insert(mem_tag(offset+typesize,start_typesize,start,start->value.type));
-		newtag->value.next = start->value.next;
-		start->value.type = qtype;
-		start->value.next = newtag;
-		start->value.typesize = typesize;
-		start->value.count = 1;
-		return;
 	}
+	replace(lo-first, hi-first, out, n);
+}
 
-	start->value.count = start_lastvalid;
-	if(alignbytes != 0){
-		// if we are misaligned, we need to add a raw tag
-		rbnode<mem_tag>* rawtag = tags.insert(mem_tag(start_offset+start_validbytes,alignbytes,start,RawType));
-		start->value.next = rawtag;
-		rbnode<mem_tag>* start_next = start->value.next;
-		newtag = tags.insert(mem_tag(offset,typesize,rawtag,qtype));
-		rawtag->value.next = newtag;
-		newtag->value.next = start_next;
-		deal_with_end(newtag, start_next, offset+typesize);
-		return;
+// puts the n tags of with in place of the tags from index i up to j
+void tag_map::replace(size_t i, size_t j, const mem_tag* with, size_t n) const{
+	size_t now = many != nullptr ? many->size() : (has_one ? 1 : 0);
+	size_t total = now-(j-i)+n;
+	if(many == nullptr){
+		if(total <= 1){
+			has_one = (total == 1);
+			if(has_one){
+				one = (n == 1) ? with[0] : one;
+			}
+			return;
+		}
+		many = take_tag_vector();
+		if(has_one) many->push_back(one);
+		has_one = false;
+	}
+	std::vector<mem_tag>& v = *many;
+	size_t same = std::min(j-i, n);
+	std::copy(with, with+same, v.begin()+i);
+	if(j-i > n){
+		v.erase(v.begin()+i+n, v.begin()+j);
+	} else {
+		v.insert(v.begin()+j, with+same, with+n);
+	}
+	if(v.size() == 1){
+		one = v[0];
+		has_one = true;
+		give_tag_vector(many);
+		many = nullptr;
 	}
-	rbnode<mem_tag>* start_next = start->value.next;
-	newtag = tags.insert(mem_tag(offset,typesize,start,qtype));
-	newtag->value.next = start_next;
-	start->value.next = newtag;
-	deal_with_end(newtag, start_next, offset+typesize);
 }
 
 // handles internal bookkeeping of combining/splitting items
 void mem_block::write(const EmuVal* obj, size_t offset){
+	if(memtype == MEM_TYPE_FREED){
+		err_exit("Tried to write to freed memory");
+	}
 	size_t s = size;
 	if(offset > s){
 		bad_memwrite();
@@ -241,20 +361,215 @@ void mem_block::write(const EmuVal* obj, size_t offset){
 	}
 
 	// actually perform the write
-	obj->dump_repr(&((char*)data)[offset]);
+	obj->dump_repr(at(offset));
+	cut_tags(at(offset+typesize), s-offset-typesize);
+
+	tags.write(offset, typesize, obj->obj_type);
+}
+
+// Blocks this big are mapped instead, so the host only commits the pages the
+// program touches; the others read as zero, which is TAG_NONE in the tag plane.
+static const size_t MAPPED_BLOCK_BYTES = (size_t)1 << 20;
+
+// bytes to allocate for a block of s bytes and its tag plane; pointers keep
+// their offset in 32 bits, so a block can't be bigger than that reaches
+static size_t block_bytes(size_t s){
+	if(s > UINT32_MAX){
+		err_exit("Block too large for a pointer to address");
+	}
+	if(s > SIZE_MAX - tag_plane_size(s)){
+		err_exit("Out of memory");
+	}
+	return s+tag_plane_size(s);
+}
+
+static char* alloc_block(size_t s){
+	size_t n = block_bytes(s);
+	if(s < MAPPED_BLOCK_BYTES){
+		char* ans = new char[n];
+		memset(ans+s, 0, tag_plane_size(s)); // TAG_NONE
+		return ans;
+	}
+	void* ans = mmap(nullptr, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(ans == MAP_FAILED){
+		err_exit("Out of memory");
+	}
+	return (char*)ans;
+}
+
+static void free_block(void* data, size_t s){
+	if(data == nullptr) return;
+	if(s < MAPPED_BLOCK_BYTES){
+		delete[] ((char*)data);
+	} else {
+		munmap(data, s+tag_plane_size(s));
+	}
+}
+
+// Heap blocks up to HEAP_MAX_CHUNK bytes (with their tag plane) are chunks of
+// a size class: multiples of 16 bytes up to 256, then four classes for each
+// doubling. Chunks are cut from slabs and go back on their class's free list,
+// but only after waiting in a FIFO quarantine of up to -heap-quarantine bytes,
+// filled with HEAP_POISON, so freed memory isn't handed straight back out.
+// Slabs are kept until exit, so the heap never grows past its peak.
+static const size_t HEAP_MAX_CHUNK = (size_t)1 << 16;
+static const size_t HEAP_SLAB_BYTES = (size_t)1 << 18;
+static const unsigned HEAP_CLASSES = 16 + 4*8;
+static const uint8_t HEAP_POISON = 0xdb;
+
+class heap_chunk{
+public:
+	char* data;
+	unsigned cls;
+	size_t bytes;
+};
+
+class heap_arena{
+public:
+	~heap_arena(void){
+		for(char* slab : slabs) delete[] slab;
+	}
 
-	update_tag_write(obj, offset);
+	char* take(size_t);
+	void give(char*, size_t);
+
+private:
+	static unsigned class_of(size_t, size_t*);
+	void carve(unsigned, size_t);
+
+	std::vector<char*> free_lists[HEAP_CLASSES];
+	std::deque<heap_chunk> quarantine;
+	size_t quarantined = 0; // bytes
+	std::vector<char*> slabs;
+};
+
+static heap_arena heap;
+
+// the class for n bytes, and the size of its chunks
+unsigned heap_arena::class_of(size_t n, size_t* bytes){
+	if(n <= 256){
+		unsigned c = (n == 0) ? 1 : (n+15)/16;
+		*bytes = (size_t)c*16;
+		return c-1;
+	}
+	unsigned p = 63 - __builtin_clzll(n-1); // 2^p < n <= 2^(p+1), p >= 8
+	size_t step = (size_t)1 << (p-2);
+	unsigned q = (n - ((size_t)1 << p) + step - 1) / step; // 1 to 4
+	*bytes = ((size_t)1 << p) + q*step;
+	return 16 + (p-8)*4 + q-1;
 }
 
-void mem_block::free(void){
+void heap_arena::carve(unsigned c, size_t bytes){
+	char* slab = new char[HEAP_SLAB_BYTES];
+	slabs.push_back(slab);
+	for(size_t at = HEAP_SLAB_BYTES/bytes; at > 0; at--){
+		free_lists[c].push_back(slab + (at-1)*bytes);
+	}
+}
+
+// n bytes, or null if that is too big for a size class
+char* heap_arena::take(size_t n){
+	if(n > HEAP_MAX_CHUNK) return nullptr;
+	size_t bytes;
+	unsigned c = class_of(n, &bytes);
+	if(free_lists[c].empty()){
+		carve(c, bytes);
+	}
+	char* ans = free_lists[c].back();
+	free_lists[c].pop_back();
+	return ans;
+}
+
+void heap_arena::give(char* data, size_t n){
+	heap_chunk chunk;
+	chunk.data = data;
+	chunk.cls = class_of(n, &chunk.bytes);
+	memset(data, HEAP_POISON, chunk.bytes);
+	quarantine.push_back(chunk);
+	quarantined += chunk.bytes;
+	while(quarantined > HeapQuarantine){
+		const heap_chunk& old = quarantine.front();
+		free_lists[old.cls].push_back(old.data);
+		quarantined -= old.bytes;
+		quarantine.pop_front();
+	}
+}
+
+static char* alloc_heap_block(size_t s){
+	char* ans = heap.take(block_bytes(s));
+	if(ans != nullptr){
+		memset(ans+s, 0, tag_plane_size(s)); // TAG_NONE
+	}
+	return ans;
+}
+
+static void release_data(mem_block* b){
+	switch(b->storage){
+	case STORAGE_OWN:
+		free_block(b->data, b->size);
+		break;
+	case STORAGE_HEAP:
+		if(b->data != nullptr) heap.give((char*)b->data, b->size+tag_plane_size(b->size));
+		break;
+	case STORAGE_FRAME:
+		break; // goes with the frame
+	}
+}
+
+// deletes the block, or if it is in a frame's space, destroys it there and
+// lets the space go if it was waiting on this block
+static void destroy(mem_block* b){
+	if(b->storage != STORAGE_FRAME){
+		delete b;
+		return;
+	}
+	frame_space* f = b->frame;
+	b->~mem_block();
+	if(--f->blocks == 0 && f->popped){
+		delete[] (char*)f;
+	}
+}
+
+void mem_block::free(death_t why){
+	active_mem.bury(this, why);
 	memtype = MEM_TYPE_FREED;
-	delete ((char*)data);
+	release_data(this);
+	data = nullptr;
+	shadow = nullptr;
+	tags.clear();
+	if(pins == 0){
+		destroy(this);
+	}
+}
+
+void mem_block::unpin(void){
+	pins--;
+	if(pins == 0 && memtype == MEM_TYPE_FREED){
+		destroy(this);
+	}
 }
 
 mem_block::mem_block(mem_type_t t, size_t s)
-	:id(new_block_id()),size(s),memtype(t),data(new char[s]),firsttag(nullptr),tags()
+	:id(new_block_id()),size(s),memtype(t),data(nullptr),storage(STORAGE_OWN),frame(nullptr),pins(0),tags()
 {
-	active_mem.insert(std::make_pair(id,this));
+	if(t == MEM_TYPE_HEAP){
+		data = alloc_heap_block(s);
+		if(data != nullptr) storage = STORAGE_HEAP;
+	}
+	if(data == nullptr){
+		data = alloc_block(s);
+	}
+	shadow = (uint8_t*)data+s;
+	active_mem.insert(this);
+}
+
+mem_block::mem_block(mem_type_t t, const EmuVal* obj, frame_space* f)
+	:id(new_block_id()),size(obj->size()),memtype(t),data(this+1),storage(STORAGE_FRAME),frame(f),pins(0),tags()
+{
+	shadow = (uint8_t*)data+size;
+	memset(shadow, 0, tag_plane_size(size)); // TAG_NONE
+	active_mem.insert(this);
+	write(obj, 0);
 }
 
 mem_block::mem_block(mem_type_t t, const EmuVal* obj)
@@ -264,8 +579,245 @@ mem_block::mem_block(mem_type_t t, const EmuVal* obj)
 }
 
 mem_block::~mem_block(void){
-	delete[] ((char*)data);
-	active_mem.erase(id);
+	release_data(this);
+	if(memtype != MEM_TYPE_FREED){
+		active_mem.retire(id);
+		active_mem.erase(id);
+	}
+}
+
+block_table::~block_table(void){
+	for(page* p : pages) delete p;
+}
+
+void block_table::insert(mem_block* b){
+	size_t s = slot_of(b->id);
+	size_t p = s >> PAGE_BITS;
+	if(p >= pages.size()) pages.resize(p+1, nullptr);
+	if(pages[p] == nullptr){
+		pages[p] = new page();
+	}
+	pages[p]->slots[s & (PAGE_SLOTS-1)] = b;
+	pages[p]->live++;
+}
+
+void block_table::erase(block_id_t id){
+	size_t s = slot_of(id);
+	size_t p = s >> PAGE_BITS;
+	if(p >= pages.size() || pages[p] == nullptr) return;
+	mem_block*& slot = pages[p]->slots[s & (PAGE_SLOTS-1)];
+	if(slot == nullptr || slot->id != id) return;
+	slot = nullptr;
+	// an empty page is kept while new or reused ids may still land in it; it
+	// can go once ids aren't recycled and the counter has moved past its end
+	if(--pages[p]->live == 0 && !recycle_block_ids && id_counter >= ((block_id_t)(p+1) << PAGE_BITS)){
+		delete pages[p];
+		pages[p] = nullptr;
+	}
+}
+
+static bool same_death(const tombstone& a, const tombstone& b){
+	return a.why == b.why && a.where == b.where && a.source == b.source;
+}
+
+void block_table::bury(const mem_block* b, death_t why){
+	tombstone t;
+	t.last = b->id;
+	t.size = b->size;
+	t.where = curr_loc.getRawEncoding();
+	t.why = why;
+	t.source = curr_source;
+
+	// blocks let go of together, e.g. the locals of a scope or a loop of
+	// frees, tend to have consecutive ids, so they share one record
+	auto next = graves.find(b->id+1);
+	if(next != graves.end() && same_death(next->second, t)){
+		if(next->second.size != t.size) t.size = 0;
+		t.last = next->second.last;
+		graves.erase(next);
+	}
+	auto prev = grave_of(b->id-1);
+	if(prev != graves.end() && same_death(prev->second, t)){
+		if(prev->second.size != t.size) prev->second.size = 0;
+		prev->second.last = t.last;
+	} else {
+		graves[b->id] = t;
+	}
+	retire(b->id);
+	erase(b->id);
+}
+
+std::map<block_id_t, tombstone>::iterator block_table::grave_of(block_id_t id){
+	auto it = graves.upper_bound(id);
+	if(it == graves.begin()) return graves.end();
+	--it;
+	return (it->second.last >= id) ? it : graves.end();
+}
+
+std::map<block_id_t, tombstone>::const_iterator block_table::grave_of(block_id_t id) const{
+	auto it = graves.upper_bound(id);
+	if(it == graves.begin()) return graves.end();
+	--it;
+	return (it->second.last >= id) ? it : graves.end();
+}
+
+void block_table::retire(block_id_t id){
+	if(recycle_block_ids){
+		dead.push_back(id);
+	}
+}
+
+block_id_t block_table::reuse_id(void){
+	if(dead.empty()){
+		err_exit("Too many allocations");
+	}
+	block_id_t old = dead.front();
+	dead.pop_front();
+	// cut the old id out of its run, splitting the run around it
+	auto it = grave_of(old);
+	if(it != graves.end()){
+		if(it->second.last > old){
+			graves[old+1] = it->second;
+		}
+		if(it->first < old){
+			it->second.last = old-1;
+		} else {
+			graves.erase(it);
+		}
+	}
+	EMU_LOG(LOG_MEM, LOG_LEVEL_TRACE) << "DOUG MEM DEBUG: reusing slot of block id "<<old<<"\n";
+	return old + (SLOT_MASK+1);
+}
+
+std::string block_table::gone_reason(block_id_t id) const{
+	const auto it = grave_of(id);
+	if(it == graves.end()){
+		if(in_slot(id) != nullptr){
+			return "Dereferenced a pointer to freed memory whose block id has since been reused";
+		}
+		return "Dereferenced a pointer to freed memory";
+	}
+	const tombstone& t = it->second;
+	std::string ans;
+	if(t.why == DEATH_FREED){
+		ans = "Dereferenced a pointer to heap memory freed";
+	} else {
+		ans = "Dereferenced a pointer to a local variable whose scope ended";
+	}
+	const SourceManager& sm = sources[t.source]->getSourceManager();
+	unsigned line = sm.getSpellingLineNumber(SourceLocation::getFromRawEncoding(t.where));
+	ans += " on line " + std::to_string(line);
+	if(t.size != 0){
+		ans += " (block of " + std::to_string(t.size) + " bytes)";
+	}
+	return ans;
+}
+
+block_table::const_iterator block_table::cbegin(void) const{
+	return const_iterator(this, 0);
+}
+
+block_table::const_iterator block_table::cend(void) const{
+	return const_iterator(this, pages.size() << PAGE_BITS);
+}
+
+block_table::const_iterator::const_iterator(const block_table* t, size_t i)
+	: table(t), id(i)
+{
+	skip();
+}
+
+mem_block* block_table::const_iterator::operator*(void) const{
+	return table->pages[id >> PAGE_BITS]->slots[id & (PAGE_SLOTS-1)];
+}
+
+block_table::const_iterator& block_table::const_iterator::operator++(void){
+	id++;
+	skip();
+	return *this;
+}
+
+// moves forward to the next id with a block, or the end
+void block_table::const_iterator::skip(void){
+	size_t end = table->pages.size() << PAGE_BITS;
+	while(id < end){
+		const page* p = table->pages[id >> PAGE_BITS];
+		if(p == nullptr){
+			id = ((id >> PAGE_BITS)+1) << PAGE_BITS;
+		} else if(p->slots[id & (PAGE_SLOTS-1)] == nullptr){
+			id++;
+		} else {
+			return;
+		}
+	}
+	id = end;
+}
+
+repr_ptr::repr_ptr(char* d, uint8_t* t, size_t p)
+	: data(d), tags(t), pos(p)
+{
+}
+
+tag_t read_tag(const repr_ptr& p, size_t n, size_t space){
+	if(n == 0 || n > space) return TAG_INVALID;
+	tag_t t = p.tag(0);
+	if(t == TAG_CONT) return TAG_INVALID;
+	for(size_t i = 1; i < n; i++){
+		if(p.tag(i) != TAG_CONT) return TAG_INVALID;
+	}
+	if(n < space && p.tag(n) == TAG_CONT) return TAG_INVALID;
+	return t;
+}
+
+void write_tag(repr_ptr p, size_t n, tag_t t){
+	if(n == 0) return;
+	p.set_tag(0, t);
+	size_t i = 1;
+	// whole bytes of the plane at a time once we are on a boundary
+	if((p.pos+i)%2 == 1 && i < n){
+		p.set_tag(i++, TAG_CONT);
+	}
+	if(i+1 < n){
+		size_t whole = (n-i)/2;
+		memset(&p.tags[(p.pos+i)/2], TAG_CONT | (TAG_CONT << 4), whole);
+		i += whole*2;
+	}
+	for(; i < n; i++){
+		p.set_tag(i, TAG_CONT);
+	}
+}
+
+void cut_tags(repr_ptr p, size_t space){
+	if(space > 0 && p.tag(0) == TAG_CONT){
+		p.set_tag(0, TAG_INVALID);
+	}
+}
+
+void copy_tags(repr_ptr dst, const repr_ptr& src, size_t n){
+	if(dst.pos%2 == 0 && src.pos%2 == 0){
+		memcpy(&dst.tags[dst.pos/2], &src.tags[src.pos/2], n/2);
+		if(n%2 == 1) dst.set_tag(n-1, src.tag(n-1));
+		return;
+	}
+	for(size_t i = 0; i < n; i++){
+		dst.set_tag(i, src.tag(i));
+	}
+}
+
+tag_t tag_of_id(emu_type_id_t id){
+	if((id & EMU_TYPE_UNINIT_MASK) == EMU_TYPE_UNINIT_MASK) return TAG_UNINIT;
+	switch(id){
+	case EMU_TYPE_BOOL_ID:     return TAG_BOOL;
+	case EMU_TYPE_CHAR_ID:     return TAG_CHAR;
+	case EMU_TYPE_SHORT_ID:    return TAG_SHORT;
+	case EMU_TYPE_INT_ID:      return TAG_INT;
+	case EMU_TYPE_LONG_ID:     return TAG_LONG;
+	case EMU_TYPE_LONGLONG_ID: return TAG_LONGLONG;
+	case EMU_TYPE_PTR_ID:      return TAG_PTR;
+	case EMU_TYPE_FUNC_ID:     return TAG_FUNC;
+	case EMU_TYPE_STACKPOS_ID: return TAG_STACKPOS;
+	default:                   return TAG_INVALID;
+	}
 }
 
 mem_ptr::mem_ptr(mem_block* b, size_t o)
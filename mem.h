@@ -1,23 +1,31 @@
 #pragma once
 #include <inttypes.h>
 #include <deque>
+#include <map>
 #include <stddef.h>
 #include <string>
 #include <unordered_map>
+#include <vector>
 #include "clang/AST/Type.h"
 #include "clang/AST/Stmt.h"
+#include "llvm/ADT/DenseMap.h"
 #include "enums.h"
-#include "rbtree.h"
 
 using namespace clang;
 
 class EmuVal;
 class EmuPtr;
+class frame_space;
 
 //might want to change to uint64_t later if we have too many stack vars
 // NOTE: block ID 0 to 2 (inclusive) are not used
 typedef uint32_t block_id_t;
 
+// -recycle-block-ids: see block_table
+extern bool recycle_block_ids;
+// -lazy-tags: see tag_map
+extern bool lazy_tags;
+
 uint32_t new_fid(void);
 
 #define BLOCK_ID_NULL 1
@@ -31,37 +39,221 @@ class mem_tag{
 public:
 	size_t offset; //relative to containing mem_block
 	QualType type;
-	rbnode<mem_tag> *prev;
-	rbnode<mem_tag> *next;
 	size_t typesize; //size of stored object
 	size_t count;
 
-	mem_tag(size_t, size_t, rbnode<mem_tag>*, QualType);
-	size_t sortval(void) const;
+	mem_tag(void);
+	mem_tag(size_t, size_t, QualType);
+	mem_tag(size_t, size_t, size_t, QualType);
+
+	size_t end(void) const{
+		return offset+typesize*count;
+	}
+};
+
+// The tags of a block, sorted by offset and never overlapping. Most blocks
+// only ever hold one value, so a single tag is kept inline and a vector is
+// only made once there is a second.
+//
+// With -lazy-tags, writes are only logged as a pending run, which writes that
+// carry it on or land on one of its objects again are folded into. The run is
+// applied to the tags when a write doesn't fit it, or when the tags are looked
+// at through begin() and end().
+class tag_map{
+public:
+	tag_map(void);
+	~tag_map(void);
+
+	const mem_tag* begin(void) const{
+		if(has_pending) settle();
+		return many != nullptr ? many->data() : &one;
+	}
+	const mem_tag* end(void) const{
+		if(has_pending) settle();
+		return many != nullptr ? many->data()+many->size() : &one+(has_one ? 1 : 0);
+	}
+
+	// retags the bytes written by a value of the given size and type, merging
+	// with tags of the same type on either side; what is left of a partly
+	// overwritten tag is whole objects, with any split object tagged raw
+	void write(size_t, size_t, QualType);
+	void clear(void);
+
+private:
+	void settle(void) const;
+	void apply(const mem_tag&) const;
+	void replace(size_t, size_t, const mem_tag*, size_t) const;
+
+	// mutable so that looking at the tags can apply a pending write
+	mutable std::vector<mem_tag>* many; // null while there are fewer than two
+	mutable bool has_one;
+	mutable bool has_pending;
+	mutable mem_tag one;
+	mutable mem_tag pending;
+};
+
+// Points at a value in both planes of a block (or of a struct value): the
+// value bytes, and the tag plane holding a 4-bit tag_t for each of them.
+class repr_ptr{
+public:
+	char* data;
+	uint8_t* tags;
+	size_t pos; // index in the tag plane of the tag for data[0]
+
+	repr_ptr(char*, uint8_t*, size_t);
+
+	tag_t tag(size_t i) const{
+		size_t n = pos+i;
+		return (tag_t)((tags[n/2] >> ((n%2)*4)) & 0xF);
+	}
+	void set_tag(size_t i, tag_t t){
+		size_t n = pos+i;
+		unsigned int shift = (n%2)*4;
+		tags[n/2] = (tags[n/2] & ~(0xF << shift)) | (t << shift);
+	}
+	repr_ptr operator+(size_t o) const{
+		return repr_ptr(data+o, tags, pos+o);
+	}
+};
+
+// bytes of tag plane needed for n bytes of values
+static inline size_t tag_plane_size(size_t n){
+	return (n+1)/2;
+}
+
+// The tag of the value of n bytes at the pointer, or TAG_INVALID if what is
+// there isn't exactly one value of that size; the size_t is how many bytes
+// can be read from the pointer.
+tag_t read_tag(const repr_ptr&, size_t, size_t);
+// marks n bytes as one value with the given tag
+void write_tag(repr_ptr, size_t, tag_t);
+// after writing a value that ended partway through an older one, makes sure
+// the rest of the older one no longer reads as part of anything
+void cut_tags(repr_ptr, size_t);
+void copy_tags(repr_ptr, const repr_ptr&, size_t);
+tag_t tag_of_id(emu_type_id_t);
+
+// All that is kept of a run of consecutive blocks once they have died in the
+// same way at the same statement, so that pointers still leading to them can
+// be explained.
+class tombstone{
+public:
+	block_id_t last; // the run is from the id it is filed under up to this
+	size_t size; // of each block, or 0 if they weren't all the same
+	unsigned where; // raw SourceLocation of the statement it died in
+	uint8_t why; // death_t
+	int16_t source;
 };
 
 class mem_block{
-friend class mem_tag;
 public:
 	mem_block(mem_type_t, const EmuVal*);
 	mem_block(mem_type_t, size_t);
+	// placed in the frame's space by new_local, with its data and tag plane
+	// right after it
+	mem_block(mem_type_t, const EmuVal*, frame_space*);
 	~mem_block(void);
 
 	size_t sortval(void) const;
 	void write(const EmuVal*, size_t);
-	void free(void);
+	// Releases the data and tags, leaving a tombstone in active_mem. The
+	// block itself is destroyed now, or when the last EmuPtr holding it goes.
+	void free(death_t);
+	void pin(void){
+		pins++;
+	}
+	void unpin(void);
+
+	repr_ptr at(size_t offset){
+		return repr_ptr((char*)data+offset, shadow, offset);
+	}
 
 	const block_id_t id;
 	const size_t size; // extra space is uninit
 	mem_type_t memtype;
 	void* data;
-	rbnode<mem_tag>* firsttag;
+	uint8_t* shadow; // the tag plane, allocated just after data
+	storage_t storage;
+	frame_space* frame; // holding the block, if STORAGE_FRAME
+	unsigned pins; // EmuPtrs holding the block
+	tag_map tags;
+};
+
+// Maps block ids to their blocks. Ids are handed out in increasing order, so
+// this is an array of pages indexed directly by id; a page is allocated when
+// its first block is made and only dropped once it is empty and no id can land
+// in it again.
+// Iteration is in id order.
+//
+// With -recycle-block-ids, only the low SLOT_BITS of an id index the table and
+// the rest are a generation. Once every slot has been used, a new block takes
+// the slot of the block that died longest ago, with the next generation, so a
+// pointer to the old block no longer finds anything.
+class block_table{
+public:
+	static const size_t PAGE_BITS = 12;
+	static const size_t PAGE_SLOTS = (size_t)1 << PAGE_BITS;
+	static const unsigned int SLOT_BITS = 24;
+	static const block_id_t SLOT_MASK = ((block_id_t)1 << SLOT_BITS) - 1;
+
+	class const_iterator{
+	public:
+		const_iterator(const block_table*, size_t);
+		mem_block* operator*(void) const;
+		const_iterator& operator++(void);
+		bool operator!=(const const_iterator& o) const{
+			return id != o.id;
+		}
+	private:
+		void skip(void);
+		const block_table* table;
+		size_t id;
+	};
+
+	~block_table(void);
+
+	// nullptr if there is no block with the id
+	mem_block* find(block_id_t id) const{
+		mem_block* b = in_slot(id);
+		if(b == nullptr || b->id != id) return nullptr;
+		return b;
+	}
+	void insert(mem_block*);
+	void erase(block_id_t);
+
+	// takes a dying block out, leaving its tombstone
+	void bury(const mem_block*, death_t);
+	// a block has died, so its slot may be given to a new block later
+	void retire(block_id_t);
+	// the next generation of the slot that has been dead longest
+	block_id_t reuse_id(void);
+	// explains why a pointer to the id no longer points to anything
+	std::string gone_reason(block_id_t) const;
+
+	const_iterator cbegin(void) const;
+	const_iterator cend(void) const;
 
 private:
-	rbtree<mem_tag> tags;
-	void remove_tag(mem_tag*);
-	void update_tag_write(const EmuVal*, size_t);
-	void deal_with_end(rbnode<mem_tag>*, rbnode<mem_tag>*, size_t);
+	class page{
+	public:
+		mem_block* slots[PAGE_SLOTS];
+		size_t live;
+	};
+	static size_t slot_of(block_id_t id){
+		return recycle_block_ids ? (id & SLOT_MASK) : id;
+	}
+	mem_block* in_slot(block_id_t id) const{
+		size_t p = slot_of(id) >> PAGE_BITS;
+		if(p >= pages.size() || pages[p] == nullptr) return nullptr;
+		return pages[p]->slots[slot_of(id) & (PAGE_SLOTS-1)];
+	}
+	std::vector<page*> pages;
+	std::deque<block_id_t> dead; // retired ids, oldest first
+	// the run of dead ids that id is in, or graves.end()
+	std::map<block_id_t, tombstone>::iterator grave_of(block_id_t);
+	std::map<block_id_t, tombstone>::const_iterator grave_of(block_id_t) const;
+	// by first id; with -recycle-block-ids an id is cut out when its slot is reused
+	std::map<block_id_t, tombstone> graves;
 };
 
 class mem_ptr{
@@ -80,13 +272,20 @@ public:
 	lvalue(mem_block*, QualType, size_t);
 };
 
-extern std::unordered_map<block_id_t, mem_block*> active_mem;
+extern block_table active_mem;
 extern std::unordered_map<std::string, std::deque<std::pair<int,int> > > stack_var_map;
 extern std::vector<std::vector<std::pair<std::string, lvalue> > > stack_vars;
 extern std::unordered_map<std::string, lvalue>* local_vars;
 extern std::unordered_map<std::string, int> global_vars;
 extern std::unordered_map<uint32_t, std::pair<int, const void*> > global_functions;
+extern size_t frame_base;
 
-void add_stack_var(std::string, lvalue);
-void add_stack_frame(void);
-void pop_stack_frame(void);
\ No newline at end of file
+// a variable that isn't by_name can only be found through its stack position
+void add_stack_var(std::string, lvalue, bool by_name = true);
+// the argument is how many bytes to set aside for the frame's locals
+void add_stack_frame(size_t = 0);
+void pop_stack_frame(void);
+// a block for a local of the newest frame, in that frame's space if it fits
+mem_block* new_local(const EmuVal*);
+// bytes of a frame's space that a local of the given size takes
+size_t local_space(size_t);
\ No newline at end of file
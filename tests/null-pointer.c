@@ -0,0 +1,26 @@
+// Null pointers stored to memory and loaded back must stay defined: copying
+// them around is fine, only dereferencing one is an error
+// expected: Exit value: 0
+#include <stdlib.h>
+ 
+struct node {
+  int value;
+  struct node *next;
+};
+ 
+int main()
+{
+  int *p = NULL, *q;
+  int *table[3] = {NULL, NULL, NULL};
+  struct node n = {1, NULL}, m;
+ 
+  q = p;
+  table[1] = q;
+  p = table[1];
+ 
+  m = n;
+  m.next = n.next;
+  n.next = &m;
+ 
+  return n.next->value - 1;
+}
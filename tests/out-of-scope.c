@@ -0,0 +1,16 @@
+// Reading a local variable after the function it was in has returned
+// expected: Dereferenced a pointer to a local variable whose scope ended on line 8 (block of 4 bytes)
+ 
+int *escape()
+{
+  int local = 5;
+ 
+  return &local;
+}
+ 
+int main()
+{
+  int *p = escape();
+ 
+  return p[0];
+}
@@ -0,0 +1,63 @@
+// Struct member reads and writes through . and ->, struct assignment,
+// passing a struct by value and zero-filling an array member
+// expected: Exit value: 0
+ 
+struct point {
+  int x;
+  int y;
+};
+ 
+int sum(struct point p)
+{
+  p.x = p.x + p.y;
+  return p.x;
+}
+ 
+struct name {
+  int len;
+  char text[10];
+};
+ 
+struct point shift(struct point p, int d)
+{
+  p.x += d;
+  p.y += d;
+  return p;
+}
+ 
+int main()
+{
+  struct point a = {1, 2}, b;
+  struct point *pa = &a;
+  struct name n = {1};
+ 
+  a.x = 3;
+  pa->y = pa->x + 4;
+  if (a.y != 7)
+    return 1;
+ 
+  b = a;
+  b.x = 10;
+  if (a.x != 3)
+    return 2;
+  if (b.y != 7)
+    return 3;
+ 
+  if (sum(a) != 10)
+    return 4;
+  if (a.x != 3)
+    return 5;
+ 
+  b = shift(a, 5);
+  if (b.x != 8)
+    return 6;
+  if (b.y != 12)
+    return 7;
+  if (pa->x != 3)
+    return 8;
+ 
+  if (n.text[9] != 0)
+    return 9;
+ 
+  return 0;
+}
@@ -0,0 +1,66 @@
+// Dense cases (dispatched through a table), fall-through, a sparse switch
+// and default
+// expected: Exit value: 0
+ 
+int days(int month)
+{
+  switch (month) {
+    case 2:
+      return 28;
+    case 4:
+    case 6:
+    case 9:
+    case 11:
+      return 30;
+    case 1:
+    case 3:
+    case 5:
+    case 7:
+    case 8:
+    case 10:
+    case 12:
+      return 31;
+    default:
+      return 0;
+  }
+}
+ 
+int sparse(int n)
+{
+  int r = 0;
+ 
+  switch (n) {
+    case -1000:
+      r = 1;
+      break;
+    case 7:
+      r = 2;
+    case 70000:
+      r += 3;
+      break;
+  }
+ 
+  return r;
+}
+ 
+int main()
+{
+  int m, total = 0;
+ 
+  for (m = 0; m <= 13; m++)
+    total += days(m);
+ 
+  if (total != 365)
+    return 1;
+ 
+  if (sparse(-1000) != 1)
+    return 2;
+  if (sparse(7) != 5)
+    return 3;
+  if (sparse(70000) != 3)
+    return 4;
+  if (sparse(8) != 0)
+    return 5;
+ 
+  return 0;
+}
@@ -0,0 +1,13 @@
+// Reading heap memory after it has been freed
+// expected: Dereferenced a pointer to heap memory freed on line 10 (block of 4 bytes)
+#include <stdlib.h>
+ 
+int main()
+{
+  int *heap = malloc(sizeof(int));
+ 
+  heap[0] = 4;
+  free(heap);
+ 
+  return heap[0];
+}
@@ -1,12 +1,21 @@
+#include <deque>
 #include <limits.h>
+#include <stdint.h>
+#include <string.h>
 #include "clang/AST/Decl.h"
 #include "llvm/ADT/APInt.h"
-#include "llvm/ADT/APInt.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 #include "cast.h"
 #include "exit.h"
+#include "help.h"
+#include "log.h"
 #include "types.h"
 
+bool big_endian_repr = false;
+static llvm::cl::opt<bool, true> BigEndianRepr("big-endian-repr", llvm::cl::desc("Store numbers in emulated memory big-endian rather than in host byte order"), llvm::cl::location(big_endian_repr), llvm::cl::cat(MyHelp));
+
 const llvm::APInt EMU_MAX_INT(32, INT_MAX, false);
 const llvm::APInt EMU_MIN_INT(32, (uint64_t)INT_MIN, true);
 
@@ -26,6 +35,88 @@ QualType VoidType;
 QualType VoidPtrType;
 QualType BuiltinVaListType;
 
+// a deque so entries stay put while registering one registers others
+static std::deque<type_entry> type_table;
+static llvm::DenseMap<void*, type_index_t> type_indices;
+
+static type_index_t add_type(QualType qt){
+	type_index_t id = type_table.size();
+	type_table.push_back(type_entry());
+	// recorded before looking at parts so self-referencing structs terminate
+	type_indices[qt.getAsOpaquePtr()] = id;
+
+	type_entry* t = &type_table.back();
+	t->type = qt;
+	t->kind = TYPE_KIND_OTHER;
+	t->num = NUM_TYPE_INT;
+	t->is_signed = false;
+	t->tag = EMU_TYPE_INVALID_ID;
+	t->sub = TYPE_INDEX_NONE;
+	t->count = 0;
+	t->sized = false;
+	t->size = 0;
+	t->value_sized = false;
+	t->value_size = 0;
+
+	const Type* ty = qt.getTypePtr();
+	if(ty->isIntegerType()){
+		if(find_num_type(qt, &t->num)){
+			t->kind = TYPE_KIND_NUM;
+			t->is_signed = is_num_type_signed(t->num);
+			t->tag = id_from_num_type(t->num);
+		}
+	} else if(ty->isPointerType()){
+		t->kind = TYPE_KIND_PTR;
+		t->tag = EMU_TYPE_PTR_ID;
+		t->sub = type_index(ty->getPointeeType());
+	} else if(ty->isConstantArrayType()){
+		const ConstantArrayType* type = (const ConstantArrayType*)ty;
+		t->kind = TYPE_KIND_ARRAY;
+		t->tag = EMU_TYPE_PTR_ID;
+		t->count = type->getSize().getLimitedValue();
+		t->sub = type_index(type->getElementType());
+	} else if(ty->isVariableArrayType()){
+		t->kind = TYPE_KIND_VLA;
+		t->tag = EMU_TYPE_PTR_ID;
+		t->sub = type_index(((const VariableArrayType*)ty)->getElementType());
+	} else if(ty->isFunctionType()){
+		t->kind = TYPE_KIND_FUNC;
+		t->tag = EMU_TYPE_FUNC_ID;
+	} else if(ty->isStructureType()){
+		t->kind = TYPE_KIND_STRUCT;
+		t->tag = EMU_TYPE_STRUCT_ID;
+	} else if(ty->isUnionType()){
+		t->kind = TYPE_KIND_UNION;
+		t->tag = EMU_TYPE_STRUCT_ID;
+	}
+	EMU_LOG(LOG_TYPES, LOG_LEVEL_TRACE) << "DOUG DEBUG: registered type "<<id<<" of kind "<<t->kind<<"\n";
+	return id;
+}
+
+type_index_t type_index(QualType qt){
+	auto it = type_indices.find(qt.getAsOpaquePtr());
+	if(it != type_indices.end()) return it->second;
+
+	QualType canon = qt.getCanonicalType().getUnqualifiedType();
+	type_index_t id;
+	it = type_indices.find(canon.getAsOpaquePtr());
+	if(it != type_indices.end()){
+		id = it->second;
+	} else {
+		id = add_type(canon);
+	}
+	type_indices[qt.getAsOpaquePtr()] = id;
+	return id;
+}
+
+type_entry* type_at(type_index_t id){
+	return &type_table[id];
+}
+
+type_entry* type_lookup(QualType qt){
+	return &type_table[type_index(qt)];
+}
+
 EmuVal::EmuVal(status_t s, QualType t)
 	:status(s),obj_type(t)
 {
@@ -33,6 +124,39 @@ EmuVal::EmuVal(status_t s, QualType t)
 
 EmuVal::~EmuVal(void) {}
 
+// every EmuVal class fits in a slot; anything bigger uses the allocator
+static const size_t EMU_VAL_SLOT = 64;
+static const size_t EMU_VAL_SLOTS_PER_CHUNK = 256;
+static void* free_slots = nullptr;
+
+void* EmuVal::operator new(size_t n){
+	if(n > EMU_VAL_SLOT){
+		return ::operator new(n);
+	}
+	if(free_slots == nullptr){
+		char* chunk = (char*)::operator new(EMU_VAL_SLOT*EMU_VAL_SLOTS_PER_CHUNK);
+		for(size_t i = 0; i < EMU_VAL_SLOTS_PER_CHUNK; i++){
+			void* slot = chunk + i*EMU_VAL_SLOT;
+			*(void**)slot = free_slots;
+			free_slots = slot;
+		}
+	}
+	void* ans = free_slots;
+	free_slots = *(void**)ans;
+	return ans;
+}
+
+// the destructors are virtual, so n is the size of the most derived class
+void EmuVal::operator delete(void* p, size_t n){
+	if(p == nullptr) return;
+	if(n > EMU_VAL_SLOT){
+		::operator delete(p);
+		return;
+	}
+	*(void**)p = free_slots;
+	free_slots = p;
+}
+
 void EmuVal::print(void) const{
 	switch(status){
 	case STATUS_UNDEFINED:
@@ -46,68 +170,160 @@ void EmuVal::print(void) const{
 	}
 }
 
-static BuiltinType::Kind get_gen_kind(const EmuNumGeneric* a, const EmuNumGeneric* b){
-	QualType qa = a->obj_type.getCanonicalType();
-	QualType qb = b->obj_type.getCanonicalType();
-	if(!isa<BuiltinType>(qa) || !isa<BuiltinType>(qb)){
+EmuNumGeneric::EmuNumGeneric(status_t s, num_type_t T)
+	: EmuVal(s, type_from_num_type(T)), raw(0), width(bits_in_num_type(T)), repr_type_id(id_from_num_type(T))
+{
+}
+
+EmuNumGeneric::EmuNumGeneric(status_t s, num_type_t T, uint64_t v)
+	: EmuVal(s, type_from_num_type(T)), raw(v), width(bits_in_num_type(T)), repr_type_id(id_from_num_type(T))
+{
+}
+
+EmuNumGeneric::~EmuNumGeneric() {}
+
+bool EmuNumGeneric::equals(const EmuNumGeneric* other) const {
+	if(EMU_LOG_ON(LOG_TYPES, LOG_LEVEL_TRACE)){
+		llvm::errs() << "DOUG DEBUG: comparing two numbers: " << raw << " " << other->raw << "\n";
+	}
+	return raw == other->raw;
+}
+
+int64_t EmuNumGeneric::sext(void) const{
+	if(width == 64) return (int64_t)raw;
+	uint64_t sign = (uint64_t)1 << (width-1);
+	return (int64_t)((raw ^ sign) - sign);
+}
+
+#define NUMCASES(DOCASE) \
+	DOCASE(NUM_TYPE_BOOL) \
+	DOCASE(NUM_TYPE_CHAR) \
+	DOCASE(NUM_TYPE_UCHAR) \
+	DOCASE(NUM_TYPE_SHORT) \
+	DOCASE(NUM_TYPE_USHORT) \
+	DOCASE(NUM_TYPE_INT) \
+	DOCASE(NUM_TYPE_UINT) \
+	DOCASE(NUM_TYPE_LONG) \
+	DOCASE(NUM_TYPE_ULONG) \
+	DOCASE(NUM_TYPE_LONGLONG) \
+	DOCASE(NUM_TYPE_ULONGLONG)
+
+// the num_traits of each num_type_t, in enum order, for emu_num, which only
+// knows its type at run time
+class num_info{
+public:
+	uint64_t mask;
+	unsigned int bits;
+	bool is_signed;
+};
+
+#define DOCASE(T) { num_traits<T>::mask, num_traits<T>::bits, num_traits<T>::is_signed },
+static const num_info num_infos[] = {
+	NUMCASES(DOCASE)
+};
+#undef DOCASE
+
+emu_num::emu_num(status_t s, num_type_t t, uint64_t v)
+	: status(s), type(t), raw(v & num_infos[t].mask)
+{
+}
+
+emu_num::emu_num(const EmuVal* v){
+	const type_entry* t = type_lookup(v->obj_type);
+	if(t->kind != TYPE_KIND_NUM){
+		v->obj_type.dump();
 		cant_cast();
 	}
-	const BuiltinType* ba = (const BuiltinType*)qa.getTypePtr();
-	if(!ba->isInteger()){
-		cant_cast();
+	status = v->status;
+	type = t->num;
+	raw = ((const EmuNumGeneric*)v)->raw;
+}
+
+const EmuNumGeneric* emu_num::box(void) const{
+	#define DOCASE(T) case T: return new EmuNum<T>(status, raw);
+	switch(type){
+		NUMCASES(DOCASE)
 	}
-	const BuiltinType* bb = (const BuiltinType*)qb.getTypePtr();
-	BuiltinType::Kind ans = ba->getKind();
-	if(ans != bb->getKind()){
-		cant_cast();
+	#undef DOCASE
+	cant_cast();
+}
+
+// goes through a temporary EmuNum so the tags are written the same way
+void emu_num::store(mem_block* block, size_t offset) const{
+	#define DOCASE(T) case T: { const EmuNum<T> v(status, raw); block->write(&v, offset); return; }
+	switch(type){
+		NUMCASES(DOCASE)
 	}
-	return ans;
+	#undef DOCASE
+	cant_cast();
 }
 
-EmuNumGeneric::EmuNumGeneric(status_t s, num_type_t T)
-	: EmuVal(s, type_from_num_type(T)), repr_type_id(id_from_num_type(T))
-{
+#undef NUMCASES
+
+int64_t emu_num::sext(void) const{
+	unsigned int bits = num_infos[type].bits;
+	if(bits == 64) return (int64_t)raw;
+	uint64_t sign = (uint64_t)1 << (bits-1);
+	return (int64_t)((raw ^ sign) - sign);
 }
 
-EmuNumGeneric::EmuNumGeneric(status_t s, num_type_t T, llvm::APInt v)
-	: EmuVal(s, type_from_num_type(T)), val(v), repr_type_id(id_from_num_type(T))
-{
+// as EmuNum::cast_to, which also gives a defined value whatever the status
+emu_num emu_num::cast_to(QualType qt) const{
+	const type_entry* target = type_lookup(qt);
+	if(target->kind != TYPE_KIND_NUM) cant_cast();
+	if(num_infos[type].is_signed && !target->is_signed){
+		return emu_num(STATUS_UNDEFINED, target->num, 0);
+	}
+	return emu_num(STATUS_DEFINED, target->num, raw);
 }
 
-EmuNumGeneric::~EmuNumGeneric() {}
+// both sides of an operation have to be the same type
+static status_t join_nums(const emu_num& a, const emu_num& b){
+	if(a.type != b.type) cant_cast();
+	return (a.status < b.status) ? a.status : b.status;
+}
 
-bool EmuNumGeneric::equals(const EmuNumGeneric* other) const {
-	llvm::errs() << "DOUG DEBUG: comparing two numbers:\n";
-	val.dump();
-	other->val.dump();
-	return val == other->val;
-}
-
-#define DOOP(str) \
-const EmuNumGeneric* EmuNumGeneric::str (const EmuNumGeneric* other) const{ \
-	switch(get_gen_kind(this,other)){ \
-	case BuiltinType::Bool:      return ((const EmuNum<NUM_TYPE_BOOL>*      )this)->str((const EmuNum<NUM_TYPE_BOOL>*     )other); \
-	case BuiltinType::SChar:     return ((const EmuNum<NUM_TYPE_CHAR>*      )this)->str((const EmuNum<NUM_TYPE_CHAR>*     )other); \
-	case BuiltinType::UChar:     return ((const EmuNum<NUM_TYPE_UCHAR>*     )this)->str((const EmuNum<NUM_TYPE_UCHAR>*    )other); \
-	case BuiltinType::Short:     return ((const EmuNum<NUM_TYPE_SHORT>*     )this)->str((const EmuNum<NUM_TYPE_SHORT>*    )other); \
-	case BuiltinType::UShort:    return ((const EmuNum<NUM_TYPE_USHORT>*    )this)->str((const EmuNum<NUM_TYPE_USHORT>*   )other); \
-	case BuiltinType::Int:       return ((const EmuNum<NUM_TYPE_INT>*       )this)->str((const EmuNum<NUM_TYPE_INT>*      )other); \
-	case BuiltinType::UInt:      return ((const EmuNum<NUM_TYPE_UINT>*      )this)->str((const EmuNum<NUM_TYPE_UINT>*     )other); \
-	case BuiltinType::Long:      return ((const EmuNum<NUM_TYPE_LONG>*      )this)->str((const EmuNum<NUM_TYPE_LONG>*     )other); \
-	case BuiltinType::ULong:     return ((const EmuNum<NUM_TYPE_ULONG>*     )this)->str((const EmuNum<NUM_TYPE_ULONG>*    )other); \
-	case BuiltinType::LongLong:  return ((const EmuNum<NUM_TYPE_LONGLONG>*  )this)->str((const EmuNum<NUM_TYPE_LONGLONG>* )other); \
-	case BuiltinType::ULongLong: return ((const EmuNum<NUM_TYPE_ULONGLONG>* )this)->str((const EmuNum<NUM_TYPE_ULONGLONG>*)other); \
-	default: \
-		cant_cast(); \
-	} \
-} \
-
-DOOP(add)
-DOOP(sub)
-DOOP(mul)
-DOOP(div)
-DOOP(_or)
-DOOP(_and)
+#define NUMOP(name, expr) \
+emu_num emu_num::name(const emu_num& other) const{ \
+	status_t s = join_nums(*this, other); \
+	if(s != STATUS_DEFINED) return emu_num(s, type, 0); \
+	return emu_num(STATUS_DEFINED, type, expr); \
+}
+
+NUMOP(add, raw + other.raw)
+NUMOP(sub, raw - other.raw)
+NUMOP(mul, raw * other.raw)
+NUMOP(_or, raw | other.raw)
+NUMOP(_and, raw & other.raw)
+
+#undef NUMOP
+
+emu_num emu_num::div(const emu_num& other) const{
+	status_t s = join_nums(*this, other);
+	if(s != STATUS_DEFINED) return emu_num(s, type, 0);
+	if(other.raw == 0){
+		return emu_num(STATUS_UNDEFINED, type, 0);
+	}
+	if(!num_infos[type].is_signed){
+		return emu_num(STATUS_DEFINED, type, raw / other.raw);
+	}
+	int64_t b = other.sext();
+	// the one quotient that doesn't fit wraps around, as in APInt::sdiv
+	if(b == -1){
+		return emu_num(STATUS_DEFINED, type, (uint64_t)0 - raw);
+	}
+	return emu_num(STATUS_DEFINED, type, (uint64_t)(sext() / b));
+}
+
+emu_num emu_num::lnot(void) const{
+	if(status != STATUS_DEFINED) return emu_num(status, type, 0);
+	return emu_num(STATUS_DEFINED, type, (raw == 0) ? 1 : 0);
+}
+
+emu_num emu_num::neg(void) const{
+	if(status != STATUS_DEFINED) return emu_num(status, type, 0);
+	return emu_num(STATUS_DEFINED, type, (uint64_t)0 - raw);
+}
 
 // Uses little endian
 
@@ -313,39 +529,46 @@ const EmuULong* EmuULong::multiply(const EmuULong* other) const{
 EmuPtr::EmuPtr(status_t s, QualType t)
 	: EmuVal(s,t),offset(0)
 {
+	u.block = nullptr;
 }
 
 EmuPtr::EmuPtr(mem_ptr ptr, QualType t)
 	: EmuVal(STATUS_DEFINED, t),offset(ptr.offset)
 {
 	u.block = ptr.block;
+	if(u.block != nullptr) u.block->pin();
 }
 
-EmuPtr::EmuPtr(const void* p, QualType qt)
+EmuPtr::EmuPtr(const repr_ptr& p, size_t space, QualType qt)
 	: EmuVal(STATUS_UNDEFINED, qt)
 {
-	const emu_type_id_t* type_ptr = (const emu_type_id_t*) p;
-	const block_id_t* bid_ptr = (const block_id_t*)(type_ptr+1);
-	const size_t* offset_ptr = (const size_t*)(bid_ptr+1);
+	uint64_t v = read_repr<uint64_t>(p.data);
+	block_id_t id = (block_id_t)(v >> 32);
+	offset = (uint32_t)v;
 
-	emu_type_id_t t = *type_ptr;
-	block_id_t id = *bid_ptr;
-	offset = *offset_ptr;
-	switch(t){
-	case EMU_TYPE_PTR_ID | EMU_TYPE_UNINIT_MASK:
+	emu_type_id_t t = EMU_TYPE_INVALID_ID;
+	switch(read_tag(p, EMU_SIZE_PTR, space)){
+	case TAG_UNINIT:
 		status = STATUS_UNINITIALIZED;
 		break;
-	case EMU_TYPE_PTR_ID:
+	case TAG_PTR:
 	{
-		llvm::errs() << "DOUG DEBUG: looking at mem for id "<<id<<" [offset="<<offset<<"]\n";
-		auto it = active_mem.find(id);
-		if(it != active_mem.end()){
+		EMU_LOG(LOG_TYPES, LOG_LEVEL_TRACE) << "DOUG DEBUG: looking at mem for id "<<id<<" [offset="<<offset<<"]\n";
+		if(id == BLOCK_ID_NULL){
+			status = STATUS_DEFINED;
+			u.block = nullptr;
+			return;
+		}
+		mem_block* block = active_mem.find(id);
+		if(block != nullptr){
 			status = STATUS_DEFINED;
-			mem_block* block = it->second;
 			u.block = block;
+			block->pin();
 			return;
 		}
-		// else fall-through
+		// else a pointer to a block that has gone
+		t = EMU_TYPE_PTR_ID;
+		break;
 	}
 	default:
 		status = STATUS_UNDEFINED;
@@ -354,9 +577,16 @@ EmuPtr::EmuPtr(const void* p, QualType qt)
 	u.repr.block_id = id;
 }
 
-EmuPtr::~EmuPtr(void) {}
+// a block that has died stays around while it is pointed to from here
+EmuPtr::~EmuPtr(void){
+	if(status == STATUS_DEFINED && u.block != nullptr){
+		u.block->unpin();
+	}
+}
 
-const size_t EMU_SIZE_PTR = sizeof(emu_type_id_t)+sizeof(mem_block::id)+sizeof(EmuPtr::offset);
+// the block id and offset, as one 64 bit word laid out like the integer that
+// a pointer casts to, (id << 32) + offset
+const size_t EMU_SIZE_PTR = sizeof(uint64_t);
 
 size_t EmuPtr::size(void) const{
 	return EMU_SIZE_PTR;
@@ -366,33 +596,35 @@ void EmuPtr::print_impl(void) const{
 	llvm::outs() << "<ptr to block " << u.block->id << " offset " << offset << ">";
 }
 
-void EmuPtr::dump_repr(void* p) const{
-	emu_type_id_t* type_ptr = (emu_type_id_t*) p;
-	block_id_t* bid_ptr = (block_id_t*)(type_ptr+1);
-	size_t* offset_ptr = (size_t*)(bid_ptr+1);
+void EmuPtr::dump_repr(repr_ptr p) const{
+	block_id_t bid;
+	size_t off;
 	switch(status){
 	case STATUS_DEFINED:
 	{
-		*type_ptr = EMU_TYPE_PTR_ID;
 		mem_block *block = u.block;
 		if(block == nullptr){
-			*bid_ptr = BLOCK_ID_NULL;
+			bid = BLOCK_ID_NULL;
 		} else {
-			*bid_ptr = block->id;
+			bid = block->id;
 		}
-		*offset_ptr = offset;
+		off = offset;
+		// an offset outside of 32 bits is far out of bounds of any block
+		write_tag(p, EMU_SIZE_PTR, (off > UINT32_MAX) ? TAG_INVALID : TAG_PTR);
 		break;
 	}
 	case STATUS_UNDEFINED:
-		*type_ptr = u.repr.type_id;
-		*bid_ptr = u.repr.block_id;
-		*offset_ptr = offset;
+		write_tag(p, EMU_SIZE_PTR, tag_of_id(u.repr.type_id));
+		bid = u.repr.block_id;
+		off = offset;
 		break;
 	case STATUS_UNINITIALIZED:
-		*type_ptr = EMU_TYPE_PTR_ID | EMU_TYPE_UNINIT_MASK;
-		*bid_ptr = BLOCK_ID_INVALID;
-		*offset_ptr = SIZE_MAX;
+	default:
+		write_tag(p, EMU_SIZE_PTR, TAG_UNINIT);
+		bid = BLOCK_ID_INVALID;
+		off = UINT32_MAX;
 	}
+	write_repr<uint64_t>(p.data, ((uint64_t)bid << 32) | (uint32_t)off);
 }
 
 // assumes STATUS_DEFINED
@@ -425,22 +657,20 @@ EmuFunc::EmuFunc(uint32_t f, QualType t)
 {
 }
 
-EmuFunc::EmuFunc(const void* p, QualType qt)
+EmuFunc::EmuFunc(const repr_ptr& p, size_t space, QualType qt)
 	:EmuVal(STATUS_UNDEFINED, qt)
 {
-	const emu_type_id_t* type_ptr = (const emu_type_id_t*)p;
-	const uint32_t* id_ptr = (const uint32_t*)(type_ptr+1);
-	emu_type_id_t t = *type_ptr;
-	repr_type_id = t;
-	uint32_t id = *id_ptr;
-	func_id = id;
-	switch(t){
-		case EMU_TYPE_FUNC_ID | EMU_TYPE_UNINIT_MASK:
+	func_id = (uint32_t)read_repr<uint32_t>(p.data);
+	repr_type_id = EMU_TYPE_INVALID_ID;
+	switch(read_tag(p, EMU_SIZE_FUNC, space)){
+		case TAG_UNINIT:
 			status = STATUS_UNINITIALIZED;
+			repr_type_id = EMU_TYPE_FUNC_ID | EMU_TYPE_UNINIT_MASK;
 			break;
-		case EMU_TYPE_FUNC_ID:
-			if(global_functions.find(id) != global_functions.end()){
+		case TAG_FUNC:
+			if(global_functions.find(func_id) != global_functions.end()){
 				status = STATUS_DEFINED;
+				repr_type_id = EMU_TYPE_FUNC_ID;
 				break;
 			}
 			// else fall-through
@@ -449,14 +679,9 @@ EmuFunc::EmuFunc(const void* p, QualType qt)
 	}
 }
 
-EmuFunc::EmuFunc(const void* p)
-	: EmuFunc(p,RawType)
-{
-}
-
 EmuFunc::~EmuFunc(void){}
 
-const size_t EMU_SIZE_FUNC = sizeof(emu_type_id_t)+sizeof(EmuFunc::func_id);
+const size_t EMU_SIZE_FUNC = sizeof(EmuFunc::func_id);
 
 size_t EmuFunc::size(void) const{
 	return EMU_SIZE_FUNC;
@@ -466,11 +691,9 @@ void EmuFunc::print_impl(void) const{
 	llvm::outs() << "<function machine code>";
 }
 
-void EmuFunc::dump_repr(void* p) const {
-	emu_type_id_t* type_ptr = (emu_type_id_t*)p;
-	uint32_t* id_ptr = (uint32_t*)(type_ptr+1);
-	*type_ptr = repr_type_id;
-	*id_ptr = func_id;
+void EmuFunc::dump_repr(repr_ptr p) const {
+	write_tag(p, EMU_SIZE_FUNC, tag_of_id(repr_type_id));
+	write_repr<uint32_t>(p.data, func_id);
 }
 
 // assumes STATUS_DEFINED
@@ -495,7 +718,7 @@ void EmuVoid::print_impl(void) const{
 	llvm::outs() << "<void>";
 }
 
-void EmuVoid::dump_repr(void*) const{
+void EmuVoid::dump_repr(repr_ptr) const{
 	err_exit("Tried to write void to memory");
 }
 
@@ -503,30 +726,27 @@ const EmuVal* EmuVoid::cast_to(QualType) const{
 	err_exit("Tried to cast void");
 }
 
-const size_t EMU_SIZE_STACKPOS = sizeof(EmuStackPos::repr_type_id)+sizeof(EmuStackPos::level)+sizeof(EmuStackPos::num);
+const size_t EMU_SIZE_STACKPOS = sizeof(EmuStackPos::level)+sizeof(EmuStackPos::num);
 
 EmuStackPos::EmuStackPos(unsigned int l, unsigned int n)
 	: EmuVal(STATUS_DEFINED,BuiltinVaListType), repr_type_id(EMU_TYPE_STACKPOS_ID), level(l), num(n)
 {
 }
 
-EmuStackPos::EmuStackPos(const void* p)
+EmuStackPos::EmuStackPos(const repr_ptr& p, size_t space)
 	: EmuVal(STATUS_UNDEFINED,BuiltinVaListType)
 {
-	const emu_type_id_t* type = (const emu_type_id_t*)p;
-	const int* lptr = (const int*)(type+1);
-	const int* nptr = (const int*)(lptr+1);
-	
-	emu_type_id_t t = *type;
-	level = *lptr;
-	num = *nptr;
-	repr_type_id = t;
-	switch(t){
-	case EMU_TYPE_STACKPOS_ID | EMU_TYPE_UNINIT_MASK:
+	memcpy(&level, p.data, sizeof(level));
+	memcpy(&num, p.data+sizeof(level), sizeof(num));
+	repr_type_id = EMU_TYPE_INVALID_ID;
+	switch(read_tag(p, EMU_SIZE_STACKPOS, space)){
+	case TAG_UNINIT:
 		status = STATUS_UNINITIALIZED;
+		repr_type_id = EMU_TYPE_STACKPOS_ID | EMU_TYPE_UNINIT_MASK;
 		break;
-	case EMU_TYPE_STACKPOS_ID:
+	case TAG_STACKPOS:
 		status = STATUS_DEFINED;
+		repr_type_id = EMU_TYPE_STACKPOS_ID;
 		break;
 	default:
 		status = STATUS_UNDEFINED;
@@ -544,151 +764,149 @@ void EmuStackPos::print_impl(void) const{
 	llvm::outs() << "(reference to variable at stack frame "<<level<<" number "<<num<<"\n";
 }
 
-void EmuStackPos::dump_repr(void* p) const{
-	emu_type_id_t* type = (emu_type_id_t*)p;
-	int* intout = (int*)(type+1);
-	*type = repr_type_id;
-	intout[0] = level;
-	intout[1] = num;
+void EmuStackPos::dump_repr(repr_ptr p) const{
+	write_tag(p, EMU_SIZE_STACKPOS, tag_of_id(repr_type_id));
+	memcpy(p.data, &level, sizeof(level));
+	memcpy(p.data+sizeof(level), &num, sizeof(num));
 }
 
 const EmuVal* EmuStackPos::cast_to(QualType t) const{
 	cant_cast();
 }
 
+static const record_layout* layout_of(QualType qt){
+	const type_entry* t = type_lookup(qt);
+	if(t->kind != TYPE_KIND_STRUCT && t->kind != TYPE_KIND_UNION) return nullptr;
+	return get_layout(((const RecordType*)t->type.getTypePtr())->getDecl());
+}
+
 EmuStruct::EmuStruct(status_t s, QualType qt, unsigned int n, const EmuVal** m)
-	: EmuVal(s, qt), members(m), num(n)
+	: EmuVal(s, qt)
 {
-	switch(s){
-	case STATUS_DEFINED:
-		repr_type_id = EMU_TYPE_STRUCT_ID;
-		break;
-	case STATUS_UNINITIALIZED:
-		repr_type_id = EMU_TYPE_STRUCT_ID | EMU_TYPE_UNINIT_MASK;
-		break;
-	case STATUS_UNDEFINED:
-		repr_type_id = EMU_TYPE_INVALID_ID;
-		break;
+	const record_layout* layout = layout_of(qt);
+	if(layout != nullptr){
+		if(n > layout->offsets.size()) cant_handle();
+		len = layout->size;
+	} else {
+		// an array, the members just follow one another
+		len = 0;
+		for(unsigned int i = 0; i < n; i++){
+			len += m[i]->size();
+		}
+	}
+	body = new char[len+tag_plane_size(len)];
+	repr_ptr p = image();
+	memset(p.tags, 0, tag_plane_size(len));
+	size_t o = 0;
+	for(unsigned int i = 0; i < n; i++){
+		if(layout != nullptr) o = layout->offsets[i];
+		if(o + m[i]->size() > len) cant_handle();
+		m[i]->dump_repr(p+o);
+		o += m[i]->size();
+		cut_tags(p+o, len-o);
+		delete m[i];
 	}
-	llvm::errs() << "DOUG DEBUG: new emustruct at "<<((void*)this)<<"\n";
+	delete[] m;
+	EMU_LOG(LOG_TYPES, LOG_LEVEL_TRACE) << "DOUG DEBUG: new emustruct at "<<((void*)this)<<"\n";
 }
 
-// special case: if null pointer, just makes them up
-EmuStruct::EmuStruct(lvalue l)
-	: EmuVal(STATUS_DEFINED,l.type), members()
+EmuStruct::EmuStruct(status_t s, QualType qt, const EmuStruct* other)
+	: EmuVal(s, qt), body(new char[other->len+tag_plane_size(other->len)]), len(other->len)
 {
-	status_t tempstatus;
-
-	if(l.ptr.block != nullptr){
-		size_t space = l.ptr.block->size - l.ptr.offset;
-		if(space < sizeof(emu_type_id_t)) err_exit("Tried to read undefined memory");
+	memcpy(body, other->body, len+tag_plane_size(len));
+}
 
-		const emu_type_id_t* type_ptr = (const emu_type_id_t*)l.ptr.block->data;
-		emu_type_id_t t = *type_ptr;
-		repr_type_id = t;
+static status_t tag_status(tag_t t){
+	switch(t){
+	case TAG_NONE:
+	case TAG_CONT:
+	case TAG_INVALID:
+		return STATUS_UNDEFINED;
+	case TAG_UNINIT:
+		return STATUS_UNINITIALIZED;
+	default:
+		return STATUS_DEFINED;
+	}
+}
 
-		switch(t){
-			case EMU_TYPE_STRUCT_ID | EMU_TYPE_UNINIT_MASK:
-				tempstatus = STATUS_UNINITIALIZED;
-				break;
-			case EMU_TYPE_STRUCT_ID:
-				tempstatus = STATUS_DEFINED;
-				break;
-			default:
-				tempstatus = STATUS_UNDEFINED;
-		}
-	} else {
-		tempstatus = STATUS_UNINITIALIZED;
-		repr_type_id = EMU_TYPE_STRUCT_ID | EMU_TYPE_UNINIT_MASK;
-	}
-	size_t o = sizeof(emu_type_id_t);
-
-	const TagDecl* defn = ((const RecordType*)l.type.getCanonicalType().getTypePtr())->getDecl()->getDefinition();
-	if(defn == nullptr){
-		llvm::outs() << "\n\n";
-		l.type.getTypePtr()->dump();
-		llvm::outs() << "\n\n";
-		l.type.getCanonicalType().getTypePtr()->dump();
-		llvm::outs() << "\n\n";
-		const RecordType* r = (const RecordType*)l.type.getCanonicalType().getTypePtr();
-		r->dump();
-		llvm::outs() << "\n\n";
-		r->getDecl()->dump();
-		llvm::outs() << "\n\n";
-		err_exit("Dealing with undefined record");
-	}
-	unsigned int fields = 0;
-	for(auto it = defn->decls_begin(); it != defn->decls_end(); it++){
-		fields++;
-	}
-	const EmuVal** temp_members = new const EmuVal*[fields];
-	auto it = defn->decls_begin();
-	for(unsigned int i=0; i<fields; i++){
-		const Decl* d = *it;
-		if(!isa<ValueDecl>(d)){
-			err_exit("Error with record member");
-		}
-		const ValueDecl* vd = (const ValueDecl*)d;
-		llvm::errs() << "DOUG DEBUG: trying to interpret field of decl ";
-		vd->dump();
-		llvm::errs() << " and offset " << (l.ptr.offset+o) << "\n";
-		const EmuVal* temp = from_lvalue(lvalue(l.ptr.block, vd->getType(), l.ptr.offset+o));
-		temp_members[i] = temp;
-		status_t s = temp->status;
-		if(s != tempstatus){
-			if(s == STATUS_UNDEFINED){
-				tempstatus = s;
-			} else if(tempstatus != STATUS_UNDEFINED && s != STATUS_DEFINED){
-				tempstatus = s;
-			}
+// A struct is as defined as its least defined field, which the tags alone
+// tell without decoding anything. Fields can be written one at a time, so
+// there is no tag for the struct as a whole to go stale.
+static status_t record_status(const record_layout* layout, const repr_ptr& p){
+	if(layout->offsets.empty()) return STATUS_DEFINED;
+	if(layout->is_union){
+		// whichever member was last written decides
+		return tag_status(p.tag(0));
+	}
+	status_t ans = STATUS_DEFINED;
+	for(size_t i = 0; i < layout->offsets.size(); i++){
+		const record_layout* sub = layout_of(layout->types[i]);
+		status_t s;
+		if(sub != nullptr){
+			s = record_status(sub, p+layout->offsets[i]);
+		} else {
+			s = tag_status(p.tag(layout->offsets[i]));
 		}
+		if(s < ans) ans = s;
 	}
-	members = temp_members;
-	num = fields;
-	if(tempstatus != STATUS_DEFINED) status = tempstatus;
+	return ans;
 }
 
-EmuStruct::~EmuStruct(void) {
-	if(STATUS_DEFINED){
-		for(unsigned int i = 0; i < num; i++){
-			delete members[i];
+EmuStruct::EmuStruct(const repr_ptr* p, size_t space, QualType qt)
+	: EmuVal(STATUS_DEFINED, qt)
+{
+	const record_layout* layout = layout_of(qt);
+	if(layout == nullptr) cant_handle();
+	len = layout->size;
+	body = new char[len+tag_plane_size(len)];
+	repr_ptr dst = image();
+
+	if(p == nullptr){
+		status = STATUS_UNINITIALIZED;
+		memset(dst.tags, 0, tag_plane_size(len));
+		for(size_t i = 0; i < layout->offsets.size(); i++){
+			const EmuVal* temp = from_repr(layout->types[i], nullptr, 0);
+			size_t o = layout->offsets[i];
+			temp->dump_repr(dst+o);
+			cut_tags(dst+o+temp->size(), len-o-temp->size());
+			delete temp;
 		}
-		delete members;
+		return;
 	}
+
+	if(space < len) bad_memread();
+	memcpy(body, p->data, len);
+	copy_tags(dst, *p, len);
+	status = record_status(layout, dst);
+	EMU_LOG(LOG_TYPES, LOG_LEVEL_TRACE) << "DOUG DEBUG: read struct of "<<len<<" bytes with status "<<status<<"\n";
+}
+
+EmuStruct::~EmuStruct(void) {
+	delete[] body;
 }
 
 size_t EmuStruct::size(void) const {
-	size_t ans = sizeof(repr_type_id);
-	for(unsigned int i = 0; i < num; i++){
-		ans += members[i]->size();
-	}
-	return ans;
+	return len;
 }
 
 void EmuStruct::print_impl(void) const{
 	llvm::outs() << "<struct>";
 }
 
-void EmuStruct::dump_repr(void* p) const{
-	emu_type_id_t* type_ptr = (emu_type_id_t*)p;
-	*type_ptr = repr_type_id;
-	size_t offset = sizeof(repr_type_id);
-	char* ptr = (char*)p;
-	for(unsigned int i = 0; i < num; i++){
-		members[i]->dump_repr((void*)(ptr+offset));
-		offset += members[i]->size();
-	}
+void EmuStruct::dump_repr(repr_ptr p) const{
+	memcpy(p.data, body, len);
+	copy_tags(p, image(), len);
 }
 
 const EmuVal* EmuStruct::cast_to(QualType qt) const {
-	if(qt.getCanonicalType() != obj_type.getCanonicalType()){
+	if(type_index(qt) != type_index(obj_type)){
 		cant_cast();
 	}
-	const EmuVal** newmemb = new const EmuVal*[num];
-	for(unsigned int i = 0; i < num; i++){
-		llvm::errs() << "DOUG DEBUG: struct attempting to copy member "<<i<<" of type\n";
-		members[i]->obj_type.dump();
-		newmemb[i] = members[i]->cast_to(members[i]->obj_type);
-	}
-	return new EmuStruct(status, qt, num, newmemb);
+	return new EmuStruct(status, qt, this);
+}
+
+const EmuVal* EmuStruct::member(const record_layout* layout, unsigned int i) const{
+	size_t o = layout->offsets[i];
+	repr_ptr p = image()+o;
+	return from_repr(layout->types[i], &p, len-o);
 }
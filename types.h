@@ -1,5 +1,6 @@
 #pragma once
 #include <stddef.h>
+#include <string.h>
 #include <unistd.h>
 #include "llvm/ADT/APInt.h"
 #include "llvm/Support/raw_ostream.h"
@@ -29,6 +30,10 @@ extern QualType VoidType;
 extern QualType VoidPtrType;
 extern QualType BuiltinVaListType;
 
+// -big-endian-repr: numbers in memory are written most significant byte first
+// instead of in host order, so raw dumps read the same on any host
+extern bool big_endian_repr;
+
 extern const size_t EMU_SIZE_PTR;
 extern const size_t EMU_SIZE_FUNC;
 extern const size_t EMU_SIZE_STACKPOS;
@@ -39,12 +44,17 @@ public:
 
 	virtual size_t size(void) const = 0;
 	virtual void print_impl(void) const = 0;
-	virtual void dump_repr(void*) const = 0;
+	virtual void dump_repr(repr_ptr) const = 0;
 	virtual const EmuVal* cast_to(QualType) const = 0;
 	void print(void) const;
 	status_t status;
 	QualType obj_type;
 
+	// values are made and freed for nearly every expression, so the small
+	// ones are kept on a free list rather than going back to the allocator
+	static void* operator new(size_t);
+	static void operator delete(void*, size_t);
+
 protected:
 	EmuVal(status_t, QualType);
 };
@@ -52,21 +62,19 @@ protected:
 class EmuNumGeneric : public EmuVal{
 public:
 	EmuNumGeneric(status_t, num_type_t);
-	EmuNumGeneric(status_t, num_type_t, llvm::APInt);
+	EmuNumGeneric(status_t, num_type_t, uint64_t);
 	
 	virtual ~EmuNumGeneric(void);
 
-	const EmuNumGeneric* add(const EmuNumGeneric*) const;
-	const EmuNumGeneric* sub(const EmuNumGeneric*) const;
-	const EmuNumGeneric* mul(const EmuNumGeneric*) const;
-	const EmuNumGeneric* div(const EmuNumGeneric*) const;
-	const EmuNumGeneric* _or(const EmuNumGeneric*) const;
-	const EmuNumGeneric* _and(const EmuNumGeneric*) const;
-	virtual const EmuNumGeneric* lnot(void) const = 0;
-	virtual const EmuNumGeneric* neg(void) const = 0;
+	// arithmetic is done on emu_num values
 	bool equals(const EmuNumGeneric*) const;
 
-	llvm::APInt val;
+	// the value, sign extended from its width whether or not the type is signed
+	int64_t sext(void) const;
+	uint64_t zext(void) const {return raw;}
+
+	uint64_t raw; // bits of the value, zero above its width
+	unsigned int width;
 	emu_type_id_t repr_type_id;
 };
 
@@ -172,149 +180,224 @@ __attribute__((unused)) static bool is_num_type_signed(num_type_t t) {
         }
 }
 
+// false if the type isn't one of the integer types we handle
+__attribute__((unused)) static bool find_num_type(QualType numtype, num_type_t* ans) {
+        QualType qt = numtype.getCanonicalType();
+        if(!qt->isBuiltinType()) return false;
+        const BuiltinType* ty = (const BuiltinType*)qt.getTypePtr();
+        switch(ty->getKind()){
+                case BuiltinType::Bool:
+                        *ans = NUM_TYPE_BOOL; return true;
+                case BuiltinType::Char_S:
+                case BuiltinType::SChar:
+                        *ans = NUM_TYPE_CHAR; return true;
+                case BuiltinType::Char_U:
+                case BuiltinType::UChar:
+                        *ans = NUM_TYPE_UCHAR; return true;
+                case BuiltinType::Short:
+                        *ans = NUM_TYPE_SHORT; return true;
+                case BuiltinType::UShort:
+                        *ans = NUM_TYPE_USHORT; return true;
+                case BuiltinType::Int:
+                        *ans = NUM_TYPE_INT; return true;
+                case BuiltinType::UInt:
+                        *ans = NUM_TYPE_UINT; return true;
+                case BuiltinType::Long:
+                        *ans = NUM_TYPE_LONG; return true;
+                case BuiltinType::ULong:
+                        *ans = NUM_TYPE_ULONG; return true;
+                case BuiltinType::LongLong:
+                        *ans = NUM_TYPE_LONGLONG; return true;
+                case BuiltinType::ULongLong:
+                        *ans = NUM_TYPE_ULONGLONG; return true;
+                default:
+                        return false;
+        }
+}
+
 __attribute__((unused)) static num_type_t getNumType(QualType numtype) {
+        num_type_t ans;
+        if(find_num_type(numtype, &ans)) return ans;
         QualType qt = numtype.getCanonicalType();
         if(qt->isBuiltinType()){
-                const BuiltinType* ty = (const BuiltinType*)qt.getTypePtr();
-                switch(ty->getKind()){
-                        case BuiltinType::Bool:
-                                return NUM_TYPE_BOOL;
-                        case BuiltinType::Char_S:
-                        case BuiltinType::SChar:
-                                return NUM_TYPE_CHAR;
-                        case BuiltinType::Char_U:
-                        case BuiltinType::UChar:
-                                return NUM_TYPE_UCHAR;
-                        case BuiltinType::Short:
-                                return NUM_TYPE_SHORT;
-                        case BuiltinType::UShort:
-                                return NUM_TYPE_USHORT;
-                        case BuiltinType::Int:
-                                return NUM_TYPE_INT;
-                        case BuiltinType::UInt:
-                                return NUM_TYPE_UINT;
-                        case BuiltinType::Long:
-                                return NUM_TYPE_LONG;
-                        case BuiltinType::ULong:
-                                return NUM_TYPE_ULONG;
-                        case BuiltinType::LongLong:
-                                return NUM_TYPE_LONGLONG;
-                        case BuiltinType::ULongLong:
-                                return NUM_TYPE_ULONGLONG;
-                        default:
-                                break;
-                }
 		llvm::errs() << "DOUG DEBUG: could not get type of ";
-		ty->dump();
+		qt.getTypePtr()->dump();
 		llvm::errs() << "\n";
         }
         cant_cast();
 }
 
+typedef uint32_t type_index_t;
+static const type_index_t TYPE_INDEX_NONE = (type_index_t)-1;
+
+// What the emulator needs to know about a type, worked out once per canonical
+// type so hot paths can switch on the kind instead of asking clang again.
+// Sizes are filled in by cast.cpp on first use, since working them out fails
+// for types that can't be sized.
+class type_entry{
+public:
+	QualType type; // canonical and unqualified
+	type_kind_t kind;
+	num_type_t num; // TYPE_KIND_NUM only
+	bool is_signed;
+	emu_type_id_t tag; // tag_of_id gives the tag a defined value gets in memory
+	type_index_t sub; // pointee or element type
+	size_t count; // elements in a constant array
+	bool sized;
+	size_t size; // bytes the type takes up in memory
+	bool value_sized;
+	size_t value_size; // size of the value from_lvalue gives for the type
+};
+
+// every QualType asked about, canonical or not, is remembered, so repeat
+// lookups are a single hash probe
+type_index_t type_index(QualType);
+type_entry* type_at(type_index_t);
+type_entry* type_lookup(QualType);
+
+// compile time widths and signedness of each num_type_t, matching the
+// functions above
+template <num_type_t NumType> struct num_traits;
+
+#define NUM_TRAITS(T, BITS, SIGNED, STORAGE) \
+template <> struct num_traits<T>{ \
+	typedef STORAGE storage; /* what a value is loaded and stored as */ \
+	static const unsigned int bits = BITS; \
+	static const bool is_signed = SIGNED; \
+	static const uint64_t mask = (BITS == 64) ? ~(uint64_t)0 : (((uint64_t)1 << (BITS % 64)) - 1); \
+};
+
+NUM_TRAITS(NUM_TYPE_BOOL,       1, false, uint8_t)
+NUM_TRAITS(NUM_TYPE_CHAR,       8, true, uint8_t)
+NUM_TRAITS(NUM_TYPE_UCHAR,      8, false, uint8_t)
+NUM_TRAITS(NUM_TYPE_SHORT,     16, true, uint16_t)
+NUM_TRAITS(NUM_TYPE_USHORT,    16, false, uint16_t)
+NUM_TRAITS(NUM_TYPE_INT,       32, true, uint32_t)
+NUM_TRAITS(NUM_TYPE_UINT,      32, false, uint32_t)
+NUM_TRAITS(NUM_TYPE_LONG,      32, true, uint32_t)
+NUM_TRAITS(NUM_TYPE_ULONG,     32, false, uint32_t)
+NUM_TRAITS(NUM_TYPE_LONGLONG,  64, true, uint64_t)
+NUM_TRAITS(NUM_TYPE_ULONGLONG, 64, false, uint64_t)
+
+#undef NUM_TRAITS
+
+// reads and writes a value of type S in emulated memory, most significant byte
+// first with -big-endian-repr and in host order otherwise
+template <typename S> static inline uint64_t read_repr(const char* p){
+	if(big_endian_repr){
+		const unsigned char* b = (const unsigned char*)p;
+		uint64_t v = 0;
+		for(size_t i = 0; i < sizeof(S); i++){
+			v = (v << 8) | b[i];
+		}
+		return v;
+	}
+	S s;
+	memcpy(&s, p, sizeof(S));
+	return s;
+}
+
+template <typename S> static inline void write_repr(char* p, uint64_t v){
+	if(big_endian_repr){
+		for(int i = (int)sizeof(S)-1; i >= 0; i--){
+			p[i] = v & 0xFF;
+			v >>= 8;
+		}
+		return;
+	}
+	S s = (S)v;
+	memcpy(p, &s, sizeof(S));
+}
+
+// Values are kept in a uint64_t, wrapped to the type's width after every
+// operation, which gives the same two's complement results as fixed-width
+// hardware. Statuses are ordered so that combining two is taking the lesser.
 template <num_type_t NumType> class EmuNum : public EmuNumGeneric{
 public:
+	typedef num_traits<NumType> traits;
+
+	static uint64_t wrap(uint64_t v){
+		return v & traits::mask;
+	}
+
+	static int64_t sign_extend(uint64_t v){
+		if(traits::bits == 64) return (int64_t)v;
+		uint64_t sign = (uint64_t)1 << ((traits::bits - 1) % 64);
+		return (int64_t)((v ^ sign) - sign);
+	}
+
 	EmuNum(status_t s)
 		: EmuNumGeneric(s,NumType)
 	{
 	}
 
-	EmuNum(llvm::APInt i)
-		: EmuNumGeneric(STATUS_DEFINED,NumType,i)
+	EmuNum(status_t s, uint64_t v)
+		: EmuNumGeneric(s,NumType,wrap(v))
 	{
 	}
 
-	EmuNum(const void* p)
+	EmuNum(const repr_ptr& p, size_t space)
         : EmuNumGeneric(STATUS_UNDEFINED,NumType)
 	{
-		const emu_type_id_t* type_ptr = (const emu_type_id_t*)p;
-		unsigned int bits = bits_in_num_type(NumType);
+		const size_t vbytes = sizeof(typename traits::storage);
 
-		// val is stored big-endian to check for errors
-		const unsigned char* val_ptr = (const unsigned char*)(type_ptr+1);
-		uint64_t v = 0;
-		for(unsigned int bitsleft = bits; bitsleft > 0;){
-				unsigned char nextbyte = *val_ptr;
-				if(bitsleft < 8){
-						nextbyte &= 0xFF >> (8-bitsleft);
-						bitsleft = 0;
-				} else {
-						bitsleft -= 8;
-				}
-				v = 0x100 * v + nextbyte;
-				val_ptr++;
-		}
-		emu_type_id_t t = *type_ptr;
-		val = llvm::APInt(bits, v, is_num_type_signed(NumType));
-
-		repr_type_id=t;
-		val = v;
+		raw = wrap(read_repr<typename traits::storage>(p.data));
 
-		switch(t){
-		case EMU_TYPE_INT_ID | EMU_TYPE_UNINIT_MASK:
+		tag_t t = read_tag(p, vbytes, space);
+		if(t == tag_of_id(repr_type_id)){
+				status = STATUS_DEFINED;
+		} else if(t == TAG_UNINIT){
 				status = STATUS_UNINITIALIZED;
-				return;
-		case EMU_TYPE_INT_ID:
-				break;
-		case EMU_TYPE_ZERO_ID:
-				if(v==0) break;
-		default:
-				status = STATUS_UNDEFINED;
-				return;
+		} else {
+				repr_type_id = EMU_TYPE_INVALID_ID;
 		}
-		status = STATUS_DEFINED;
 	}
 
 	~EmuNum(void) {}
 
 	size_t size(void) const{
-		int vbits = bits_in_num_type(NumType);
-		int vbytes = (vbits+7)/8;
-		return sizeof(emu_type_id_t)+vbytes;
+		return (traits::bits+7)/8;
 	}
 
 	void print_impl(void) const{
-		llvm::outs() << val;
+		llvm::outs() << sign_extend(raw);
 	}
 
-	void dump_repr(void* p) const{
-		emu_type_id_t* type_ptr = (emu_type_id_t*)p;
-		char* val_ptr = (char*)(type_ptr+1);
-
-		int vbits = bits_in_num_type(NumType);
-		int vbytes = (vbits+7)/8;
+	void dump_repr(repr_ptr p) const{
+		int vbytes = (traits::bits+7)/8;
 		switch(status){
 		case STATUS_DEFINED:
-		case STATUS_UNDEFINED:
 		{
-				*type_ptr = repr_type_id;
+				write_tag(p, vbytes, tag_of_id(repr_type_id));
 				// actually output
-				llvm::APInt t = val;
-				for(int i = 0; i < vbytes; i++){
-						val_ptr[vbytes-i-1] = t.getZExtValue() & 0xFF;
-						t = t.lshr(8);
-				}
+				write_repr<typename traits::storage>(p.data, raw);
 				break;
 		}
+		case STATUS_UNDEFINED:
+				write_tag(p, vbytes, TAG_INVALID);
+				break;
 		case STATUS_UNINITIALIZED:
-				*type_ptr = id_from_num_type(NumType) | EMU_TYPE_UNINIT_MASK;
+				write_tag(p, vbytes, TAG_UNINIT);
 				for(int i = 0; i < vbytes; i++){
-						val_ptr[i] = (char)EMU_TYPE_INVALID_ID;
+						p.data[i] = (char)EMU_TYPE_INVALID_ID;
 				}
 				break;
 		}
 	}
 
 	const EmuVal* cast_to(QualType qt) const{
-		num_type_t t = getNumType(qt);
+		const type_entry* target = type_lookup(qt);
+		if(target->kind != TYPE_KIND_NUM) cant_cast();
+		num_type_t t = target->num;
 		bool invalid = false;
-		if(is_num_type_signed(NumType) && !is_num_type_signed(t)){
+		if(traits::is_signed && !target->is_signed){
 				invalid = true;
 		}
 		#define CASTTODOCASE(T) case T: {\
 				if(invalid){ \
 						return new EmuNum<T>(STATUS_UNDEFINED); \
 				} else { \
-						return new EmuNum<T>(llvm::APInt(bits_in_num_type(T),val.getLimitedValue(),is_num_type_signed(T))); \
+						return new EmuNum<T>(STATUS_DEFINED, raw); \
 				} \
 		} \
 
@@ -331,117 +414,49 @@ public:
 				CASTTODOCASE(NUM_TYPE_LONGLONG)
 				CASTTODOCASE(NUM_TYPE_ULONGLONG)
 		}
+		#undef CASTTODOCASE
 		cant_cast();
 	}
+};
 
-	const EmuNum<NumType>* add(const EmuNum<NumType>* other) const {
-		status_t s1 = status;
-		status_t s2 = other->status;
-		if(s1 == STATUS_UNDEFINED || s2 == STATUS_UNDEFINED){
-				return new EmuNum<NumType>(STATUS_UNDEFINED);
-		}
-		if(s1 == STATUS_UNINITIALIZED || s2 == STATUS_UNINITIALIZED){
-				return new EmuNum<NumType>(STATUS_UNINITIALIZED);
-		}
-		return new EmuNum<NumType>(val+other->val);
-	}
-
-	const EmuNum<NumType>* sub(const EmuNum<NumType>* other) const{
-		status_t s1 = status;
-		status_t s2 = other->status;
-		if(s1 == STATUS_UNDEFINED || s2 == STATUS_UNDEFINED){
-				return new EmuNum<NumType>(STATUS_UNDEFINED);
-		}
-		if(s1 == STATUS_UNINITIALIZED || s2 == STATUS_UNINITIALIZED){
-				return new EmuNum<NumType>(STATUS_UNINITIALIZED);
-		}
-		return new EmuNum<NumType>(val-other->val);
-	}
-	const EmuNum<NumType>* mul(const EmuNum<NumType>* other) const{
-		status_t s1 = status;
-		status_t s2 = other->status;
-		if(s1 == STATUS_UNDEFINED || s2 == STATUS_UNDEFINED){
-				return new EmuNum<NumType>(STATUS_UNDEFINED);
-		}
-		if(s1 == STATUS_UNINITIALIZED || s2 == STATUS_UNINITIALIZED){
-				return new EmuNum<NumType>(STATUS_UNINITIALIZED);
-		}
-		return new EmuNum<NumType>(val*other->val);
-	}
+// A number of any num_type_t passed around by value. Integer expressions are
+// evaluated into these (see eval_num), so intermediate results don't need an
+// EmuVal each; an EmuNum is only made where a value has to leave as one.
+class emu_num{
+public:
+	emu_num(status_t, num_type_t, uint64_t);
+	// the value of an EmuNum; anything else can't be cast to a number
+	explicit emu_num(const EmuVal*);
+
+	const EmuNumGeneric* box(void) const; // caller must free returned
+	void store(mem_block*, size_t) const;
+	int64_t sext(void) const;
+
+	emu_num cast_to(QualType) const;
+	emu_num add(const emu_num&) const;
+	emu_num sub(const emu_num&) const;
+	emu_num mul(const emu_num&) const;
+	emu_num div(const emu_num&) const;
+	emu_num _or(const emu_num&) const;
+	emu_num _and(const emu_num&) const;
+	emu_num lnot(void) const;
+	emu_num neg(void) const;
 
-	const EmuNum<NumType>* div(const EmuNum<NumType>* other) const{
-		status_t s1 = status;
-		status_t s2 = other->status;
-		if(s1 == STATUS_UNDEFINED || s2 == STATUS_UNDEFINED){
-				return new EmuNum<NumType>(STATUS_UNDEFINED);
-		}
-		if(s1 == STATUS_UNINITIALIZED || s2 == STATUS_UNINITIALIZED){
-				return new EmuNum<NumType>(STATUS_UNINITIALIZED);
-		}
-		if(other->val==0){
-				return new EmuNum<NumType>(STATUS_UNDEFINED);
-		}
-		if(is_num_type_signed(NumType)){
-				return new EmuNum<NumType>(val.sdiv(other->val));
-		} else {
-				return new EmuNum<NumType>(val.udiv(other->val));
-		}
-	}
-	const EmuNum<NumType>* _or(const EmuNum<NumType>* other) const{
-		status_t s1 = status;
-		status_t s2 = other->status;
-		if(s1 == STATUS_UNDEFINED || s2 == STATUS_UNDEFINED){
-				return new EmuNum<NumType>(STATUS_UNDEFINED);
-		}
-		if(s1 == STATUS_UNINITIALIZED || s2 == STATUS_UNINITIALIZED){
-				return new EmuNum<NumType>(STATUS_UNINITIALIZED);
-		}
-		return new EmuNum<NumType>(val | other->val);
-	}
-	const EmuNum<NumType>* _and(const EmuNum<NumType>* other) const{
-		status_t s1 = status;
-		status_t s2 = other->status;
-		if(s1 == STATUS_UNDEFINED || s2 == STATUS_UNDEFINED){
-				return new EmuNum<NumType>(STATUS_UNDEFINED);
-		}
-		if(s1 == STATUS_UNINITIALIZED || s2 == STATUS_UNINITIALIZED){
-				return new EmuNum<NumType>(STATUS_UNINITIALIZED);
-		}
-		return new EmuNum<NumType>(val & other->val);
-	}
-	const EmuNum<NumType>* lnot(void) const{
-		status_t s1 = status;
-		if(s1 == STATUS_UNDEFINED){
-				return new EmuNum<NumType>(STATUS_UNDEFINED);
-		}
-		if(s1 == STATUS_UNINITIALIZED){
-				return new EmuNum<NumType>(STATUS_UNINITIALIZED);
-		}
-		bool b = !val;
-		return new EmuNum<NumType> (llvm::APInt(bits_in_num_type(NumType), b, is_num_type_signed(NumType)));
-	}
-	const EmuNum<NumType>* neg(void) const{
-		status_t s1 = status;
-		if(s1 == STATUS_UNDEFINED){
-				return new EmuNum<NumType>(STATUS_UNDEFINED);
-		}
-		if(s1 == STATUS_UNINITIALIZED){
-				return new EmuNum<NumType>(STATUS_UNINITIALIZED);
-		}
-		return new EmuNum<NumType> (llvm::APInt(bits_in_num_type(NumType), - val.getLimitedValue(), is_num_type_signed(NumType)));
-	}
+	status_t status;
+	num_type_t type;
+	uint64_t raw; // bits of the value, zero above its width
 };
 
 class EmuPtr : public EmuVal{
 public:
 	EmuPtr(status_t, QualType);
 	EmuPtr(mem_ptr, QualType);
-	EmuPtr(const void*, QualType);
+	EmuPtr(const repr_ptr&, size_t, QualType);
 	~EmuPtr(void);
 
 	size_t size(void) const;
 	void print_impl(void) const;
-	void dump_repr(void*) const;
+	void dump_repr(repr_ptr) const;
 	const EmuVal* cast_to(QualType) const;
 
 	// points to a block if STATUS_DEFINED
@@ -460,13 +475,12 @@ class EmuFunc : public EmuVal{
 public:
 	EmuFunc(status_t, QualType);
 	EmuFunc(uint32_t, QualType);
-	EmuFunc(const void*);
-	EmuFunc(const void*, QualType);
+	EmuFunc(const repr_ptr&, size_t, QualType);
 	~EmuFunc(void);
 
 	size_t size(void) const;
 	void print_impl(void) const;
-	void dump_repr(void*) const;
+	void dump_repr(repr_ptr) const;
 	const EmuVal* cast_to(QualType) const;
 
 	emu_type_id_t repr_type_id;
@@ -478,39 +492,53 @@ public:
 	EmuVoid(void);
 	size_t size(void) const;
 	void print_impl(void) const;
-	void dump_repr(void*) const;
+	void dump_repr(repr_ptr) const;
 	const EmuVal* cast_to(QualType) const;
 };
 
 class EmuStackPos : public EmuVal{
 public:
 	EmuStackPos(unsigned int, unsigned int);
-	EmuStackPos(const void*);
+	EmuStackPos(const repr_ptr&, size_t);
 	~EmuStackPos(void);
 
 	size_t size(void) const;
 	void print_impl(void) const;
-	void dump_repr(void*) const;
+	void dump_repr(repr_ptr) const;
 	const EmuVal* cast_to(QualType) const;
 
 	emu_type_id_t repr_type_id;
 	unsigned int level, num;
 };
 
+class record_layout;
+
+// A struct (or union, or zero-initialized array) value is kept as a copy of
+// its memory representation, values and tags, so copying one is a single copy
+// of bytes and fields are decoded only when they are asked for.
 class EmuStruct : public EmuVal{
 public:
+	// takes ownership of the members, which are laid out and then freed
 	EmuStruct(status_t, QualType, unsigned int, const EmuVal**);
-	EmuStruct(lvalue);
+	// decodes from memory; a null pointer makes up an uninitialized value
+	EmuStruct(const repr_ptr*, size_t, QualType);
 	~EmuStruct(void);
 
 	size_t size(void) const;
 	void print_impl(void) const;
-	void dump_repr(void*) const;
+	void dump_repr(repr_ptr) const;
 	const EmuVal* cast_to(QualType) const;
+	// caller must free
+	const EmuVal* member(const record_layout*, unsigned int) const;
 
-	emu_type_id_t repr_type_id;
 private:
-	const EmuVal** members;
-	unsigned int num;
+	EmuStruct(status_t, QualType, const EmuStruct*);
+
+	repr_ptr image(void) const{
+		return repr_ptr(body, (uint8_t*)body+len, 0);
+	}
+
+	char* body; // len bytes of values followed by their tag plane
+	size_t len;
 };
 